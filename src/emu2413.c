@@ -1192,6 +1192,117 @@ void OPLL_forceRefresh(OPLL *opll) {
   }
 }
 
+/* state layout: the plain OPLL fields, per slot its plain fields, patch and wave table index, then the rate converter
+ * timer and history. Pointers are not stored, they are rebuilt from the indices on load. */
+#define STATE_NO_PATCH 0xFF
+
+#define OPLL_STATE                                                                                                     \
+  X(clk) X(rate) X(chip_type) X(adr) X(inp_step) X(out_step) X(out_time) X(reg) X(test_flag) X(slot_key_status)        \
+  X(rhythm_mode) X(eg_counter) X(pm_phase) X(am_phase) X(lfo_am) X(noise) X(short_noise) X(patch_number) X(patch)    \
+  X(pan) X(pan_fine) X(mask) X(ch_out) X(mix_out)
+
+#define SLOT_STATE                                                                                                     \
+  X(number) X(type) X(output) X(pg_phase) X(pg_out) X(pg_keep) X(blk_fnum) X(fnum) X(blk) X(eg_state) X(volume)      \
+  X(key_flag) X(sus_flag) X(tll) X(rks) X(eg_rate_h) X(eg_rate_l) X(eg_shift) X(eg_out) X(update_requests)
+
+#define CONV_STATE_SIZE (sizeof(double) + 2 * LW * sizeof(int16_t))
+
+static size_t opll_fields_size(void) {
+  size_t size = 0;
+#define X(field) size += sizeof(((OPLL *)NULL)->field);
+  OPLL_STATE
+#undef X
+  return size;
+}
+
+static size_t slot_fields_size(void) {
+  size_t size = 0;
+#define X(field) size += sizeof(((OPLL_SLOT *)NULL)->field);
+  SLOT_STATE
+#undef X
+  return size;
+}
+
+size_t OPLL_stateSize(void) { return opll_fields_size() + 18 * (slot_fields_size() + 2) + CONV_STATE_SIZE; }
+
+void OPLL_saveState(OPLL *opll, uint8_t *buf) {
+  int i;
+
+#define X(field) memcpy(buf, &opll->field, sizeof(opll->field)); buf += sizeof(opll->field);
+  OPLL_STATE
+#undef X
+
+  for (i = 0; i < 18; i++) {
+    const OPLL_SLOT *slot = &opll->slot[i];
+#define X(field) memcpy(buf, &slot->field, sizeof(slot->field)); buf += sizeof(slot->field);
+    SLOT_STATE
+#undef X
+    *buf++ = slot->patch == &null_patch ? STATE_NO_PATCH : (uint8_t)(slot->patch - opll->patch);
+    *buf++ = slot->wave_table == wave_table_map[1];
+  }
+
+  memset(buf, 0, CONV_STATE_SIZE);
+  if (opll->conv) {
+    memcpy(buf, &opll->conv->timer, sizeof(double));
+    for (i = 0; i < opll->conv->ch && i < 2; i++)
+      memcpy(buf + sizeof(double) + i * LW * sizeof(int16_t), opll->conv->buf[i], LW * sizeof(int16_t));
+  }
+}
+
+int OPLL_checkState(const uint8_t *buf) {
+  OPLL state;
+  int i;
+
+#define X(field) memcpy(&state.field, buf, sizeof(state.field)); buf += sizeof(state.field);
+  OPLL_STATE
+#undef X
+
+  for (i = 0; i < 9; i++) {
+    if (state.patch_number[i] < 0 || state.patch_number[i] >= 19)
+      return 0;
+  }
+  for (i = 0; i < 19 * 2; i++) {
+    if (state.patch[i].WS > 1)
+      return 0;
+  }
+  for (i = 0; i < 18; i++) {
+    buf += slot_fields_size();
+    if (*buf != STATE_NO_PATCH && *buf >= 19 * 2)
+      return 0;
+    buf += 2;
+  }
+  return 1;
+}
+
+int OPLL_loadState(OPLL *opll, const uint8_t *buf) {
+  OPLL_RateConv *conv = opll->conv;
+  int i;
+
+  if (!OPLL_checkState(buf))
+    return 0;
+
+#define X(field) memcpy(&opll->field, buf, sizeof(opll->field)); buf += sizeof(opll->field);
+  OPLL_STATE
+#undef X
+
+  for (i = 0; i < 18; i++) {
+    OPLL_SLOT *slot = &opll->slot[i];
+#define X(field) memcpy(&slot->field, buf, sizeof(slot->field)); buf += sizeof(slot->field);
+    SLOT_STATE
+#undef X
+    slot->patch = *buf == STATE_NO_PATCH ? &null_patch : &opll->patch[*buf];
+    buf++;
+    slot->wave_table = wave_table_map[*buf++ ? 1 : 0];
+  }
+
+  if (conv) {
+    memcpy(&conv->timer, buf, sizeof(double));
+    for (i = 0; i < conv->ch && i < 2; i++)
+      memcpy(conv->buf[i], buf + sizeof(double) + i * LW * sizeof(int16_t), LW * sizeof(int16_t));
+  }
+  return 1;
+}
+
 void OPLL_setRate(OPLL *opll, uint32_t rate) {
   opll->rate = rate;
   reset_rate_conversion_params(opll);
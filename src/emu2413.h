@@ -1,6 +1,7 @@
 #ifndef _EMU2413_H_
 #define _EMU2413_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -198,6 +199,30 @@ void OPLL_copyPatch(OPLL *, int32_t, OPLL_PATCH *);
  */
 void OPLL_forceRefresh(OPLL *);
 
+/**
+ * Size in bytes of the chip state written by OPLL_saveState.
+ */
+size_t OPLL_stateSize(void);
+
+/**
+ * Serialize the chip state, including the rate converter history, into buf.
+ * Internal pointers are stored as table indices, host pointers not at all.
+ */
+void OPLL_saveState(OPLL *, uint8_t *buf);
+
+/**
+ * Check that a chip state holds only patch and wave table indices in range.
+ * Returns 0 if it does not.
+ */
+int OPLL_checkState(const uint8_t *buf);
+
+/**
+ * Restore a chip state written by OPLL_saveState. The OPLL must have been
+ * created with the same clock and rate as the one that was saved.
+ * Returns 0 and leaves the OPLL untouched if OPLL_checkState fails.
+ */
+int OPLL_loadState(OPLL *, const uint8_t *buf);
+
 void OPLL_dumpToPatch(const uint8_t *dump, OPLL_PATCH *patch);
 void OPLL_patchToDump(const OPLL_PATCH *patch, uint8_t *dump);
 void OPLL_getDefaultPatch(int32_t type, int32_t num, OPLL_PATCH *);
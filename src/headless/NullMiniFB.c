@@ -0,0 +1,33 @@
+#include "../win32/MiniFB.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// No-op display backend for headless builds: nothing is presented and mfb_update never waits, so frames run
+// as fast as the host allows.
+
+static char key_status[512] = {0};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int mfb_open(const char *title, int width, int height, int scale) {
+    return 1;
+}
+
+void mfb_set_pallete_array(const uint32_t *new_palette, uint8_t start, uint8_t count) {
+}
+
+void mfb_set_pallete(const uint8_t color_index, const uint32_t color) {
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int mfb_update(void *buffer, int fps_limit) {
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void mfb_close() {
+}
+
+char *mfb_keystatus() {
+    return key_status;
+}
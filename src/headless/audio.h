@@ -0,0 +1,21 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../sms.h"
+#include "../sound.h"
+
+// Samples produced per emulated frame, the emulation loop generates them with audio_frame()
+#define AUDIO_BUFFER_LENGTH (SOUND_FREQUENCY / FRAMES_PER_SECOND)
+static int16_t audio_buffer[AUDIO_BUFFER_LENGTH * 2] = { 0 };
+
+// Optional raw 16-bit stereo PCM dump, samples are discarded when not set
+static FILE *audio_sink = NULL;
+
+static inline void audio_frame() {
+    sound_render(audio_buffer, AUDIO_BUFFER_LENGTH, CYCLES_PER_FRAME);
+
+    if (audio_sink) {
+        fwrite(audio_buffer, sizeof(int16_t), AUDIO_BUFFER_LENGTH * 2, audio_sink);
+    }
+}
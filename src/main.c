@@ -2,19 +2,34 @@
 #pragma GCC optimize ("unroll-loops")
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef HEADLESS
 #include <windows.h>
+#elif defined(RENDER_THREAD)
+#include <pthread.h>
+#endif
 
 #include "emu2413.h"
 #include "win32/MiniFB.h"
+#ifdef HEADLESS
+#include "headless/audio.h"
+#else
 #include "win32/audio.h"
-#include "z80/z80.h"
+#endif
+#include "z80/Z80.h"
 #include "sn76489.h"
 
+#include "rewind.h"
 #include "sms.h"
+#include "sound.h"
+#include "state.h"
 #include "vdp.h"
 // create a CPU core object
 Z80 cpu;
 OPLL *ym2413;
+SN76489 *sn76489;
 uint8_t ym2413_status;
 
 uint8_t SCREEN[SMS_WIDTH * SMS_HEIGHT + 8] = {0}; // +8 possible sprite overflow
@@ -37,81 +52,151 @@ uint8_t page_mask = 0x1f;
 
 void (*frame_function)();
 
-void WrZ80(register word address, const register byte value) {
-    if (address >= 0x2000 && address < 0x4000) {
-        rom_slot1[address] = value;
-    }
+// Turbo mode: no fps limit, window updated only every TURBO_FRAMESKIP frame
+#define TURBO_FRAMESKIP 10
+#define SPEED_REPORT_INTERVAL 1.0
 
-    if (address >= 0x8000 && address < 0xC000 && slot3_is_ram) {
-        ram_rom_slot3[address - 0x8000] = value;
-        return;
-    }
+uint8_t turbo = 0;
 
-    if (address >= 0xC000) {
-        RAM[address & 8191] = value;
+// With render_enabled cleared frames run without drawing into SCREEN, VDP status flags and interrupts are kept
+uint8_t render_enabled = 1;
 
-        if (address >= 0xFFFC) {
-            // Memory paging
-            const uint8_t page = value & page_mask; // todo check rom size
-            switch (address) {
-                case 0xFFFC:
-                    if (value >> 3 & 1) {
-                        slot3_is_ram = 1 + (value >> 2); // ram bank 2 or 1
-                    } else {
-                        slot3_is_ram = 0;
-                    }
-                    break;
-                case 0xFFFD:
-                    rom_slot1 = ROM + page * 0x4000;
-                // printf("slot 1 is ROM page %i\n", page);
-                    break;
-                case 0xFFFE:
-                    rom_slot2 = ROM + page * 0x4000;
-                    rom_slot2 -= 0x4000;
-                // printf("slot 2 is ROM page %i\n", page);
-                    break;
-                case 0xFFFF:
-                    if (slot3_is_ram) {
-                        ram_rom_slot3 = &RAM_BANK[slot3_is_ram - 2][0];
-                        printf("slot 3 is RAM bank %i\n", slot3_is_ram - 2);
-                        // ram_rom_slot3 -= 0x8000;
-                    } else {
-                        // printf("slot 3 is ROM page %i\n", page);
-                        ram_rom_slot3 = ROM + page * 0x4000;
-                        ram_rom_slot3 -= 0x8000;
-                    }
+// MG_BATCH=1 runs the CPU through a frame's active area before rendering its lines in one pass, Mode 4 only
+uint8_t batch_render = 0;
 
-                    break;
-            }
-        }
+// MG_RENDER_THREAD=1 in RENDER_THREAD builds: batched frames are drawn by a second thread while the CPU runs the next
+// one, SCREEN shows a frame one frame later
+uint8_t render_thread_enabled = 0;
+
+static double report_start = 0;
+static int report_frames = 0;
+
+// F5 saves, F8 loads <rom>.state
+static char state_filename[512 + 6];
+
+// Every frame goes into the rewind ring, sized by $MG_REWIND in MB. Holding BACKSPACE steps back a frame at a time
+static uint8_t rewind_enabled = 0;
+#ifndef HEADLESS
+static uint8_t rewinding = 0;
+#endif
+
+// 1KB granular memory map, rebuilt by memory_map() on every mapper change
+// read_page[] is also read directly by the Z80 core when built with SMS defined
+#define PAGE_SHIFT 10
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+uint8_t *read_page[0x10000 >> PAGE_SHIFT];
+uint8_t *write_page[0x10000 >> PAGE_SHIFT]; // NULL for read only pages
+static uint8_t *write_dirty[0x10000 >> PAGE_SHIFT]; // state_dirty[] flag of every write page
+
+// state_dirty[] flag of the RAM or RAM_BANK page behind memory, a scratch flag for writes landing in ROM
+static inline uint8_t *page_dirty(const uint8_t *memory) {
+    static uint8_t rom_dirty;
+
+    if (memory >= RAM && memory < RAM + sizeof(RAM)) {
+        return &state_dirty[STATE_RAM_PAGE_INDEX + ((memory - RAM) >> STATE_PAGE_SHIFT)];
+    }
+    if (memory >= RAM_BANK[0] && memory < RAM_BANK[0] + sizeof(RAM_BANK)) {
+        return &state_dirty[STATE_RAM_BANK_PAGE_INDEX + ((memory - &RAM_BANK[0][0]) >> STATE_PAGE_SHIFT)];
     }
+    return &rom_dirty;
 }
 
-byte RdZ80(const register word address) {
-    // printf("Mem read %x\n", address);
-    if (address <= 1024) {
-        // fixed 1kb
-        // non pageable
-        return ROM[address];
-    }
+void memory_map() {
+    for (uint8_t page = 0; page < 0x10000 >> PAGE_SHIFT; page++) {
+        const uint16_t address = page << PAGE_SHIFT;
+        uint8_t *memory;
+
+        if (address < 0x400 || (is_sg1000 && address < 0x2000)) {
+            // fixed 1kb, non pageable
+            memory = &ROM[address];
+        } else if (address < 0x4000) {
+            memory = &rom_slot1[address];
+        } else if (address < 0x8000) {
+            memory = &rom_slot2[address];
+        } else if (address < 0xC000) {
+            memory = &ram_rom_slot3[address];
+        } else {
+            memory = &RAM[address & 8191];
+        }
 
-    if (is_sg1000 && address < 0x2000) {
-        return ROM[address];
+        read_page[page] = memory;
+        write_page[page] = address >= 0xC000 || (address >= 0x2000 && address < 0x4000) || (address >= 0x8000 && slot3_is_ram)
+                               ? memory
+                               : NULL;
+        write_dirty[page] = page_dirty(memory);
     }
+}
 
-    if (address < 0x4000) {
-        return rom_slot1[address];
+void WrZ80(register word address, const register byte value) {
+    uint8_t *memory = write_page[address >> PAGE_SHIFT];
+
+    if (memory) {
+        memory[address & PAGE_MASK] = value;
+        *write_dirty[address >> PAGE_SHIFT] = 1;
     }
 
-    if (address < 0x8000) {
-        return rom_slot2[address];
+    if (address >= 0xFFFC) {
+        // Memory paging
+        const uint8_t page = value & page_mask; // todo check rom size
+        switch (address) {
+            case 0xFFFC:
+                if (value >> 3 & 1) {
+                    slot3_is_ram = 2 + (value >> 2 & 1); // ram bank 2 or 1
+                } else {
+                    slot3_is_ram = 0;
+                }
+                break;
+            case 0xFFFD:
+                rom_slot1 = ROM + page * 0x4000;
+            // printf("slot 1 is ROM page %i\n", page);
+                break;
+            case 0xFFFE:
+                rom_slot2 = ROM + page * 0x4000;
+                rom_slot2 -= 0x4000;
+            // printf("slot 2 is ROM page %i\n", page);
+                break;
+            case 0xFFFF:
+                if (slot3_is_ram) {
+                    ram_rom_slot3 = &RAM_BANK[slot3_is_ram - 2][0];
+                    printf("slot 3 is RAM bank %i\n", slot3_is_ram - 2);
+                } else {
+                    // printf("slot 3 is ROM page %i\n", page);
+                    ram_rom_slot3 = ROM + page * 0x4000;
+                }
+                ram_rom_slot3 -= 0x8000;
+
+                break;
+        }
+        memory_map();
     }
+}
+
+byte RdZ80(const register word address) {
+    return read_page[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
 
-    if (address < 0xC000) {
-        return ram_rom_slot3[address];
+#ifdef PROFZ80
+// ROM bank mapped at address, for the Z80 profiler
+byte BankZ80(const register word address) {
+    const uint8_t *memory = read_page[address >> PAGE_SHIFT];
+    return memory >= ROM && memory < ROM + sizeof(ROM) ? (memory - ROM) >> 14 : PROF_NOBANK;
+}
+
+// Profile goes to $MG_PROFILE at exit (CSV when it ends with .csv), stdout if unset
+static void profile_report() {
+    if (!SaveProfileZ80(getenv("MG_PROFILE"))) {
+        printf("Can't write Z80 profile to %s\n", getenv("MG_PROFILE"));
     }
+}
+#endif
 
-    return RAM[address & 8191];
+// Z80 cycle within the running frame. Line 192 runs with scanline 192, the vblank loops bump scanline before
+// running lines 193-261, so there it is one ahead of the running line
+static inline uint32_t frame_cycle() {
+    const uint16_t line = scanline > 192 ? scanline - 1 : scanline;
+    return line * CYCLES_PER_LINE + CYCLES_PER_LINE - cpu.ICount;
 }
 
 void OutZ80(register word port, register byte value) {
@@ -120,24 +205,28 @@ void OutZ80(register word port, register byte value) {
         case 0x3E:
             if (value & BIT_3) {
                 rom_slot2 = ROM + 0x4000;
+                memory_map();
             }
             if (value & BIT_2) {
                 printf("IO enabled\n");
             }
             break;
-        case 0x7E: sn76489_out(value);
-            break; // SN76489
-        case 0x7F: sn76489_out(value);
-            break; // SN76489
+        case 0x06: // Game Gear PSG stereo
+            if (is_gamegear) sound_queue_write(frame_cycle(), SOUND_PSG, port, value);
+            break;
+        case 0x7E: // SN76489
+        case 0x7F:
+            sound_queue_write(frame_cycle(), SOUND_PSG, port, value);
+            break;
 
         case 0xBE: // Data register
         case 0xBF: // Control register
-            vdp_write(port, value);
+            vdp_write(port, value, CYCLES_PER_LINE - cpu.ICount);
             break;
 
         case 0xF0:
         case 0xF1:
-            OPLL_writeIO(ym2413, port, value);
+            sound_queue_write(frame_cycle(), SOUND_FM, port, value);
             break;
         case 0xF2: ym2413_status = value & 3;
             break;
@@ -188,7 +277,54 @@ void PatchZ80(register Z80 *R) {
 }
 
 
+#ifndef HEADLESS
 void HandleInput(WPARAM wParam, BOOL isKeyDown) {
+    // Turbo while TAB is held
+    if (wParam == VK_TAB && turbo != isKeyDown) {
+        turbo = isKeyDown;
+        report_frames = 0;
+        report_start = 0;
+    }
+
+    if (wParam == VK_BACK) {
+        rewinding = isKeyDown;
+    }
+
+    if (isKeyDown && wParam == VK_F5) {
+        printf(state_save_file(state_filename) ? "State saved to %s\n" : "Can't save state to %s\n", state_filename);
+    }
+    if (isKeyDown && wParam == VK_F8) {
+        printf(state_load_file(state_filename) ? "State loaded from %s\n" : "Can't load state from %s\n", state_filename);
+    }
+}
+#endif
+
+// Print achieved frames per second and effective Z80 clock every SPEED_REPORT_INTERVAL seconds
+static inline void speed_report() {
+    const double now = host_seconds();
+
+    if (report_start == 0) {
+        report_start = now;
+        return;
+    }
+
+    report_frames++;
+
+    const double elapsed = now - report_start;
+    if (elapsed >= SPEED_REPORT_INTERVAL) {
+        const double fps = report_frames / elapsed;
+        printf("%.1f fps, %.2f MHz Z80\n", fps, fps * CYCLES_PER_FRAME / 1e6);
+
+        if (rewind_enabled) {
+            const rewind_stats stats = rewind_report();
+            printf("rewind: %.1f s in %.2f of %.2f MB, %.1f us per frame\n",
+                   (double) stats.frames / FRAMES_PER_SECOND, stats.used / 1048576.0, stats.budget / 1048576.0,
+                   stats.captures ? stats.capture_seconds * 1e6 / stats.captures : 0);
+        }
+
+        report_start = now;
+        report_frames = 0;
+    }
 }
 
 static inline size_t readfile(const char *pathname, uint8_t *dst) {
@@ -203,113 +339,350 @@ static inline size_t readfile(const char *pathname, uint8_t *dst) {
     return rom_size;
 }
 
-#define SPRITE_COUNT 64
+// Append vdp_output as one raw video frame
+static void write_video_frame(FILE *file) {
+    fwrite(vdp_output, vdp_output_format == OUTPUT_RGB565 ? 2 : 4, vdp_view_width * vdp_view_height, file);
+}
 
-// Sega Master System Frame update cycle
-static inline void sms_frame() {
-    int cpu_cycles = 0;
-    uint8_t interrut_line = vdp.registers[R10_LINE_COUNTER];
+// Rendered view as binary PPM, colors from CRAM or the TMS9918 palette
+static int save_screenshot(const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) return 0;
 
-    const uint8_t sprite_height = vdp.registers[R1_MODE_CONTROL_2] & EXTRA_HEIGHT_ENABLED ? 16 : 8;
-    const uint8_t sprites_hshift = vdp.registers[R0_MODE_CONTROL_1] & SHIFT_SPRITES_LEFT_8PIXELS ? 8 : 0;
+    fprintf(file, "P6\n%d %d\n255\n", vdp_view_width, vdp_view_height);
+    for (int i = 0; i < vdp_view_width * vdp_view_height; i++) {
+        const uint32_t color = is_sg1000 ? sg1000_palette[SCREEN[i] & 15] : vdp_cram_color(SCREEN[i] & 31);
+        const uint8_t rgb[3] = { color >> 16, color >> 8, color };
+        fwrite(rgb, 1, 3, file);
+    }
+    return fclose(file) == 0;
+}
 
-    const uint8_t hscroll_lock = vdp.registers[R0_MODE_CONTROL_1] & HORIZONTAL_SCROLL_LOCK;
-    const uint8_t vscroll = vdp.registers[R9_BACKGROUND_Y_SCROLL];
-    // const uint8_t start_column = vdp.registers[R0_MODE_CONTROL_1] & HIDE_LEFTMOST_8PIXELS ? 1 : 0;
-    const uint16_t sprites_offset = vdp.registers[R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS] & BIT_2 ? 256 : 0;
+// Registers sms_render_line() reads, changing any other one never splits a line
+#define MODE4_SPLIT_REGISTERS (1 << R0_MODE_CONTROL_1 | 1 << R1_MODE_CONTROL_2 | 1 << R2_NAMETABLE_BASE_ADDRESS | \
+                               1 << R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS | 1 << R7_OVERSCAN_COLOR)
+
+// One Mode 4 line with the given register values into line_buffer, SMS_WIDTH pixels from offset 8. The 8 bytes
+// before and after take the partly visible background column and sprites overrunning either edge.
+// hscroll is the value latched when the line started, vscroll the one latched for the frame
+static inline void sms_render_line(const uint8_t *registers, const uint8_t hscroll_latch, const uint8_t vscroll,
+                                   uint8_t *line_buffer) {
+    if (!(registers[R1_MODE_CONTROL_2] & ENABLE_DISPLAY)) {
+        memset(line_buffer + 8, registers[R7_OVERSCAN_COLOR] & 0x0f, SMS_WIDTH);
+        return;
+    }
 
-    // const int hscroll_base = 256 - vdp.registers[R8_BACKGROUND_X_SCROLL];
+    const uint8_t sprites_hshift = registers[R0_MODE_CONTROL_1] & SHIFT_SPRITES_LEFT_8PIXELS ? 8 : 0;
+    // const uint8_t start_column = registers[R0_MODE_CONTROL_1] & HIDE_LEFTMOST_8PIXELS ? 1 : 0;
+    const uint16_t sprites_offset = registers[R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS] & BIT_2 ? 256 : 0;
+    const uint8_t *nametable = &VRAM[(registers[R2_NAMETABLE_BASE_ADDRESS] << 10) & 0x3800];
 
-    for (scanline = 0; scanline < 192; scanline++) {
-        if (!(vdp.registers[R1_MODE_CONTROL_2] & ENABLE_DISPLAY)) {
-            memset(&SCREEN[scanline * SMS_WIDTH], vdp.registers[R7_OVERSCAN_COLOR] & 0x0f, SMS_WIDTH);
-        } else {
-            uint8_t priority_table[SMS_WIDTH + 8]; // allow 8 pixels overrun
+    uint8_t priority_table[8 + SMS_WIDTH + 8] = { 0 };
 
-            const int hscroll = hscroll_lock && scanline < 16 ? 0 : vdp.registers[R8_BACKGROUND_X_SCROLL];
-            const uint8_t hscroll_fine = hscroll & 7;
-            uint8_t *priority_table_ptr = priority_table + hscroll_fine;
-            const int nametable_scroll = 32 - (hscroll >> 3);
+    const int hscroll = registers[R0_MODE_CONTROL_1] & HORIZONTAL_SCROLL_LOCK && scanline < 16 ? 0 : hscroll_latch;
+    const uint8_t hscroll_fine = hscroll & 7;
+    uint8_t *priority_table_ptr = priority_table + hscroll_fine;
+    const int nametable_scroll = 32 - (hscroll >> 3);
 
-            uint8_t *screen_pixel = &SCREEN[scanline * SMS_WIDTH + hscroll_fine];
+    // fine scroll shows the right part of the column before the first full one, columns outside the view are skipped
+    const uint8_t first_column = vdp_view_x / 8, last_column = (vdp_view_x + vdp_view_width) / 8;
+    uint8_t *screen_pixel = line_buffer + hscroll_fine + first_column * 8;
+    priority_table_ptr += first_column * 8;
 
-            const uint16_t scanline_offset = (vscroll + scanline) % 224;
-            const uint8_t screen_row = scanline_offset / 8;
-            const uint8_t tile_row = scanline_offset & 7;
+    const uint16_t scanline_offset = (vscroll + scanline) % 224;
+    const uint8_t screen_row = scanline_offset / 8;
+    const uint8_t tile_row = scanline_offset & 7;
 
-            const uint16_t *tile_ptr = (uint16_t *) &vdp.nametable[screen_row * 64];
+    const uint16_t *tile_ptr = (uint16_t *) &nametable[screen_row * 64];
 
-            // background rendering loop
-            for (uint8_t column = 0; column < 32; ++column) {
-                const uint16_t tile_info = tile_ptr[(nametable_scroll + column) & 31];
-                const uint8_t priority = (tile_info & TILE_PRIORITY) >> 12;
+    // background rendering loop
+    for (uint8_t column = first_column; column <= last_column; ++column) {
+        const uint16_t tile_info = tile_ptr[(nametable_scroll + column - 1) & 31];
+        const uint8_t priority = (tile_info & TILE_PRIORITY) >> 12;
 
-                const uint8_t palette_offset = (tile_info & TILE_PALETTE) >> 7; // palette select
-                const uint16_t pattern_offset = tile_row * 4 ^ (tile_info & TILE_VERTICAL_FLIP ? 28 : 0); // vertical flip
+        const uint8_t palette_offset = (tile_info & TILE_PALETTE) >> 7; // palette select
+        const uint8_t pattern_row = tile_info & TILE_VERTICAL_FLIP ? 7 - tile_row : tile_row; // vertical flip
 
-                // Extract Tile pattern
-                const uint8_t *pattern_planes = &VRAM[pattern_offset + (tile_info & 0x1FF) * 32];
-                const uint8_t plane0 = pattern_planes[0];
-                const uint8_t plane1 = pattern_planes[1];
-                const uint8_t plane2 = pattern_planes[2];
-                const uint8_t plane3 = pattern_planes[3];
+        // Decoded tile pattern
+        const uint64_t row = vdp_tiles[tile_info & 0x1FF][pattern_row];
+        const uint64_t colors = tile_info & TILE_HORIZONTAL_FLIP ? __builtin_bswap64(row) : row;
+        const uint64_t pixels = colors + palette_offset * PLANAR_ONES;
+        const uint64_t priorities = priority ? vdp_pattern_opaque(colors) : 0;
+
+        memcpy(screen_pixel, &pixels, 8);
+        memcpy(priority_table_ptr, &priorities, 8);
+        screen_pixel += 8;
+        priority_table_ptr += 8;
+    }
+
+    // Sprites rendering loop, locals as pixel stores could alias the globals
+    const uint8_t *line_sprites = vdp_line_sprites[scanline];
+    const uint8_t line_sprite_count = vdp_line_sprite_count[scanline];
+
+    for (uint8_t sprite = 0; sprite < line_sprite_count; ++sprite) {
+        const uint8_t sprite_index = line_sprites[sprite];
+        const uint8_t sprite_x = vdp.sprites[128 + sprite_index * 2];
+        if (sprite_x + 8 - sprites_hshift <= vdp_view_x || sprite_x - sprites_hshift >= vdp_view_x + vdp_view_width) continue;
+
+        const uint64_t pattern = vdp_sprite_row(sprite_index, scanline, sprites_offset);
+        uint8_t colors[8];
+        memcpy(colors, &pattern, 8);
+
+        uint8_t *sprite_screen_pixels = line_buffer + 8 + sprite_x - sprites_hshift;
+        priority_table_ptr = priority_table + 8 + sprite_x - sprites_hshift;
 
-                if (tile_info & TILE_HORIZONTAL_FLIP) {
-#pragma GCC unroll(8)
-                    for (uint8_t bit = 0; bit < 8; ++bit) {
-                        const uint8_t color = plane0 >> bit & 1 | (plane1 >> bit & 1) << 1 | (plane2 >> bit & 1) << 2 | (plane3 >> bit & 1) << 3;
-                        *screen_pixel++ = palette_offset + color;
-                        *priority_table_ptr++ = priority && color;
-                    }
-                } else {
 #pragma GCC unroll(8)
-                    for (int8_t bit = 7; bit >= 0; --bit) {
-                        const uint8_t color = plane0 >> bit & 1 | (plane1 >> bit & 1) << 1 | (plane2 >> bit & 1) << 2 | (plane3 >> bit & 1) << 3;
-                        *screen_pixel++ = palette_offset + color;
-                        *priority_table_ptr++ = priority && color;
-                    }
-                }
+        for (uint8_t x = 0; x < 8; ++x) {
+            if (priority_table_ptr[x]) continue;
+
+            if (colors[x]) {
+                sprite_screen_pixels[x] = 16 + colors[x];
             }
+        }
+    }
+}
 
-            // Sprites rendering loop
-            uint8_t sprites_on_line = 0;
-            for (int sprite_index = 0; sprite_index < SPRITE_COUNT; ++sprite_index) {
-                const uint8_t sprite_y = vdp.sprites[sprite_index];
-                if (sprite_y == 208) break; // dont render anymore
-                if (scanline >= sprite_y && scanline < sprite_y + sprite_height) {
-                    if (sprites_on_line++ > 8) {
-                        vdp.status |= VDP_SPRITE_OVERFLOW;
-                        break;
-                    }
+// Keep the part of a rendered span [from, to) that lies in the view
+static inline void sms_view_span(uint8_t *screen_line, const uint8_t *line_buffer, uint16_t from, uint16_t to) {
+    if (from < vdp_view_x) from = vdp_view_x;
+    if (to > vdp_view_x + vdp_view_width) to = vdp_view_x + vdp_view_width;
+    if (to > from) memcpy(screen_line + from - vdp_view_x, line_buffer + 8 + from, to - from);
+}
 
-                    const uint8_t sprite_x = vdp.sprites[128 + sprite_index * 2];
+// Render scanline from the line start state, events are the writes logged during the previous line. Each register
+// change splits the line, every span is rendered in full with the registers in effect and only its pixels are kept
+static inline void sms_render_replay(const vdp_event *events, const uint16_t count, const uint8_t vscroll) {
+    uint8_t line_buffer[8 + SMS_WIDTH + 8];
+    uint8_t *screen_line = &SCREEN[(scanline - vdp_view_y) * vdp_view_width];
 
-                    const uint16_t tile_index = sprites_offset + vdp.sprites[128 + sprite_index * 2 + 1];
+    uint8_t registers[sizeof(vdp.registers)];
+    memcpy(registers, vdp_line_registers, sizeof(registers));
 
-                    // Extract Tile pattern
-                    const uint8_t *pattern_planes = &VRAM[tile_index * 32 + (scanline - sprite_y) * 4];
-                    const uint8_t plane0 = pattern_planes[0];
-                    const uint8_t plane1 = pattern_planes[1];
-                    const uint8_t plane2 = pattern_planes[2];
-                    const uint8_t plane3 = pattern_planes[3];
+    uint16_t event = 0;
+    for (; event < count && events[event].pixel == 0; event++) {
+        if (events[event].type == VDP_EVENT_REGISTER) registers[events[event].index] = events[event].value;
+    }
+    const uint8_t hscroll = registers[R8_BACKGROUND_X_SCROLL];
+
+    uint16_t x = vdp_view_x;
+    for (; event < count; event++) {
+        const vdp_event *write = &events[event];
+        if (write->type != VDP_EVENT_REGISTER || !(MODE4_SPLIT_REGISTERS >> write->index & 1)) continue;
+        if (registers[write->index] == write->value) continue;
+
+        if (write->pixel > x && x < vdp_view_x + vdp_view_width) {
+            sms_render_line(registers, hscroll, vscroll, line_buffer);
+            sms_view_span(screen_line, line_buffer, x, write->pixel);
+            x = write->pixel;
+        }
+        registers[write->index] = write->value;
+    }
+    if (x < vdp_view_x + vdp_view_width) {
+        sms_render_line(registers, hscroll, vscroll, line_buffer);
+        sms_view_span(screen_line, line_buffer, x, vdp_view_x + vdp_view_width);
+    }
+    vdp_output_line(screen_line, scanline - vdp_view_y, events, count);
+}
 
-                    uint8_t *sprite_screen_pixels = SCREEN + scanline * SMS_WIDTH + (sprite_x - sprites_hshift);
-                    priority_table_ptr = priority_table + sprite_x - sprites_hshift;
+// Batched frames render all lines after the CPU ran the active area, from the frame's write log. VRAM is taken
+// back to the frame start state and the logged writes are redone line by line, writes landing mid-line show from
+// the next one. Frames overflowing the log are drawn with the final VRAM
+static inline void sms_render_frame(const uint8_t vscroll) {
+    const uint8_t replay_vram = !vdp_log_overflow;
+    if (replay_vram) vdp_log_vram_replay(vdp_log, vdp_log_count, 1);
 
-#pragma GCC unroll(8)
-                    for (int8_t bit = 7; bit >= 0; --bit) {
-                        if (*priority_table_ptr++) continue;
+    uint16_t first = 0;
+    for (scanline = 0; scanline < 192; scanline++) {
+        uint16_t last = first;
+        while (last < vdp_log_count && vdp_log[last].line <= scanline) last++;
 
-                        const uint8_t color = plane0 >> bit & 1 | (plane1 >> bit & 1) << 1 | (plane2 >> bit & 1) << 2 | (plane3 >> bit & 1) << 3;
+        if (replay_vram) vdp_log_vram_replay(&vdp_log[first], last - first, 0);
+        vdp_update_tiles();
+        vdp_update_sprites(vdp_line_registers[R1_MODE_CONTROL_2] & EXTRA_HEIGHT_ENABLED ? 16 : 8);
 
-                        if (color) {
-                            sprite_screen_pixels[7 - bit] = 16 + color;
-                        }
-                    }
-                }
+        if (vdp_line_visible(scanline)) sms_render_replay(&vdp_log[first], last - first, vscroll);
+        vdp_log_apply(&vdp_log[first], last - first);
+        first = last;
+    }
+    if (replay_vram) vdp_log_vram_replay(&vdp_log[first], vdp_log_count - first, 0);
+}
+
+#ifdef RENDER_THREAD
+// A batched frame for the render thread: VRAM after the active area, the frame's write log and its line start state
+typedef struct {
+    uint8_t vram[VRAM_SIZE];
+    vdp_event log[VDP_LOG_SIZE];
+    uint16_t log_count;
+    uint8_t log_overflow;
+    uint8_t registers[sizeof(vdp.registers)];
+    uint32_t lut[32];
+    uint16_t sprites; // SAT offset
+    uint8_t vscroll;
+} render_job;
+
+// filled alternately, the render thread reads one while the next frame fills the other
+static render_job render_jobs[2];
+static uint8_t render_next;
+static uint8_t render_captured; // render_jobs[render_next] waits for render_submit()
+static uint8_t render_busy; // a job is with the render thread
+
+static const render_job *render_queued;
+
+// Draw a job into SCREEN with the render thread's own VDP, only tiles differing from its VRAM are decoded again
+static void render_run(const render_job *job) {
+    for (uint16_t tile = 0; tile < TILE_COUNT; tile++) {
+        if (memcmp(&VRAM[tile * 32], &job->vram[tile * 32], 32) != 0) {
+            memcpy(&VRAM[tile * 32], &job->vram[tile * 32], 32);
+            vdp_invalidate_tile(tile);
+        }
+    }
+    vdp.sprites = &VRAM[job->sprites];
+    vdp_sprites_height = 0;
+
+    memcpy(vdp_log, job->log, job->log_count * sizeof(vdp_event));
+    vdp_log_count = job->log_count;
+    vdp_log_overflow = job->log_overflow;
+    memcpy(vdp_line_registers, job->registers, sizeof(vdp_line_registers));
+    memcpy(vdp_line_lut, job->lut, sizeof(vdp_line_lut));
+
+    sms_render_frame(job->vscroll);
+}
+
+#ifdef HEADLESS
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+
+static void *render_thread(void *unused) {
+    for (;;) {
+        pthread_mutex_lock(&render_mutex);
+        while (!render_queued) pthread_cond_wait(&render_cond, &render_mutex);
+        pthread_mutex_unlock(&render_mutex);
+
+        render_run(render_queued);
+
+        pthread_mutex_lock(&render_mutex);
+        render_queued = NULL;
+        pthread_cond_broadcast(&render_cond);
+        pthread_mutex_unlock(&render_mutex);
+    }
+    return NULL;
+}
+
+static int render_start() {
+    pthread_t thread;
+    return pthread_create(&thread, NULL, render_thread, NULL) == 0;
+}
+
+static void render_handover(const render_job *job) {
+    pthread_mutex_lock(&render_mutex);
+    render_queued = job;
+    pthread_cond_broadcast(&render_cond);
+    pthread_mutex_unlock(&render_mutex);
+}
+
+static void render_join() {
+    pthread_mutex_lock(&render_mutex);
+    while (render_queued) pthread_cond_wait(&render_cond, &render_mutex);
+    pthread_mutex_unlock(&render_mutex);
+}
+#else
+static HANDLE render_ready, render_done;
+
+DWORD WINAPI render_thread(LPVOID lpParam) {
+    for (;;) {
+        WaitForSingleObject(render_ready, INFINITE);
+        render_run(render_queued);
+        SetEvent(render_done);
+    }
+}
+
+static int render_start() {
+    render_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+    render_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return render_ready && render_done && CreateThread(NULL, 0, render_thread, NULL, 0, NULL);
+}
+
+static void render_handover(const render_job *job) {
+    render_queued = job;
+    SetEvent(render_ready);
+}
+
+static void render_join() {
+    WaitForSingleObject(render_done, INFINITE);
+}
+#endif
+
+// Snapshot of the frame at the end of its active area, called by sms_frame() instead of rendering
+static inline void render_capture(const uint8_t vscroll) {
+    render_job *job = &render_jobs[render_next];
+
+    memcpy(job->vram, VRAM, VRAM_SIZE);
+    memcpy(job->log, vdp_log, vdp_log_count * sizeof(vdp_event));
+    job->log_count = vdp_log_count;
+    job->log_overflow = vdp_log_overflow;
+    memcpy(job->registers, vdp_line_registers, sizeof(job->registers));
+    memcpy(job->lut, vdp_line_lut, sizeof(job->lut));
+    job->sprites = vdp.sprites - VRAM;
+    job->vscroll = vscroll;
+
+    render_captured = 1;
+}
+
+// Wait until the frame with the render thread is in SCREEN, returns 0 if there was none
+static inline int render_wait() {
+    if (!render_busy) return 0;
+
+    render_join();
+    render_busy = 0;
+    return 1;
+}
+
+// Hand the captured frame to the render thread, SCREEN must not be read until render_wait()
+static inline void render_submit() {
+    if (!render_captured) return;
+
+    render_handover(&render_jobs[render_next]);
+    render_next ^= 1;
+    render_captured = 0;
+    render_busy = 1;
+}
+#else
+static inline void render_capture(const uint8_t vscroll) {}
+static inline int render_wait() { return 0; }
+static inline void render_submit() {}
+#endif
+
+// Sega Master System Frame update cycle
+static inline void sms_frame() {
+    int cpu_cycles = 0;
+    uint8_t interrut_line = vdp.registers[R10_LINE_COUNTER];
+
+    const uint8_t vscroll = vdp.registers[R9_BACKGROUND_Y_SCROLL];
+    const uint8_t batched = batch_render && render_enabled;
+
+    // writes from the vblank period are in effect from the first line on
+    vdp_log_flush();
+    vdp_log_vram = batched;
+
+    for (scanline = 0; scanline < 192; scanline++) {
+        // sprite evaluation, also for the overflow and collision flags when not rendering
+        vdp_update_tiles();
+        vdp_update_sprites(vdp.registers[R1_MODE_CONTROL_2] & EXTRA_HEIGHT_ENABLED ? 16 : 8);
+
+        if (vdp.registers[R1_MODE_CONTROL_2] & ENABLE_DISPLAY) {
+            const uint8_t sprites_hshift = vdp.registers[R0_MODE_CONTROL_1] & SHIFT_SPRITES_LEFT_8PIXELS ? 8 : 0;
+            const uint16_t sprites_offset = vdp.registers[R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS] & BIT_2 ? 256 : 0;
+
+            if (vdp_line_overflow[scanline]) {
+                vdp.status |= VDP_SPRITE_OVERFLOW;
             }
+            vdp_sprite_collision(scanline, sprites_hshift, sprites_offset);
         }
 
+        if (!batched) {
+            if (render_enabled && vdp_line_visible(scanline)) sms_render_replay(vdp_log, vdp_log_count, vscroll);
+            vdp_log_flush();
+        }
 
         if (vdp.registers[R0_MODE_CONTROL_1] & ENABLE_LINE_INTERRUPT) {
             if (interrut_line-- == 0) {
@@ -319,6 +692,15 @@ static inline void sms_frame() {
         }
         cpu_cycles = ExecZ80(&cpu, CYCLES_PER_LINE - cpu_cycles);
     }
+
+    if (batched) {
+        vdp_log_vram = 0;
+        if (render_thread_enabled) {
+            render_capture(vscroll);
+        } else {
+            sms_render_frame(vscroll);
+        }
+    }
     vdp.status |= VDP_VSYNC_PENDING;
 
     cpu_cycles = ExecZ80(&cpu, CYCLES_PER_LINE - cpu_cycles);
@@ -331,6 +713,7 @@ static inline void sms_frame() {
         }
         cpu_cycles = ExecZ80(&cpu, CYCLES_PER_LINE - cpu_cycles);
     }
+    sound_frame_end();
 }
 
 static inline void sg1000_frame() {
@@ -346,8 +729,11 @@ static inline void sg1000_frame() {
     const uint8_t overscan_color = vdp.registers[R7_OVERSCAN_COLOR] & 0xf;
 
     for (scanline = 0; scanline < 192; scanline++) {
-        if (!(vdp.registers[R1_MODE_CONTROL_2] & ENABLE_DISPLAY)) {
+        if (!render_enabled) {
+            // the TMS9918 has 5th sprite and collision status bits too, but this renderer does not emulate them
+        } else if (!(vdp.registers[R1_MODE_CONTROL_2] & ENABLE_DISPLAY)) {
             memset(&SCREEN[scanline * SMS_WIDTH], overscan_color, SMS_WIDTH);
+            vdp_output_line(&SCREEN[scanline * SMS_WIDTH], scanline, NULL, 0);
         } else {
             uint8_t *screen_pixel = &SCREEN[scanline * SMS_WIDTH];
 
@@ -417,7 +803,9 @@ static inline void sg1000_frame() {
                     }
                 }
             }
+            vdp_output_line(&SCREEN[scanline * SMS_WIDTH], scanline, NULL, 0);
         }
+        vdp_log_flush(); // no mid-line changes in TMS9918 modes
         cpu_cycles = ExecZ80(&cpu, CYCLES_PER_LINE - cpu_cycles);
     }
     vdp.status |= VDP_VSYNC_PENDING;
@@ -432,6 +820,7 @@ static inline void sg1000_frame() {
         }
         cpu_cycles = ExecZ80(&cpu, CYCLES_PER_LINE - cpu_cycles);
     }
+    sound_frame_end();
 }
 
 
@@ -439,13 +828,18 @@ int main(const int argc, char **argv) {
     const int scale = argc > 2 ? atoi(argv[1]) : 4;
 
     if (!argv[1]) {
+#ifdef HEADLESS
+        printf("Usage: master-gear-headless <rom.bin> [frames] [audio.raw]\n");
+#else
         printf("Usage: master-gear.exe <rom.bin> [scale_factor]\n");
+#endif
         return EXIT_FAILURE;
     }
 
 
     const char *filename = argv[1];
     const size_t len = strlen(filename);
+    snprintf(state_filename, sizeof(state_filename), "%s.state", filename);
     if (readfile(filename, ROM) == 1048576) {
         page_mask = 0x7f;
     }
@@ -455,35 +849,89 @@ int main(const int argc, char **argv) {
         if (strcmp(&filename[len - 2], "sg") == 0) is_sg1000 = 1;
     }
 
+    // Game Gear LCD shows only the middle of the display, nothing else is rendered
+    if (is_gamegear) {
+        vdp_view_x = GG_VIEW_X;
+        vdp_view_y = GG_VIEW_Y;
+        vdp_view_width = GG_VIEW_WIDTH;
+        vdp_view_height = GG_VIEW_HEIGHT;
+    }
+
     char window_title[512] = "";
     strcat(window_title, is_sg1000 ? "SG-1000 - " : is_gamegear ? "Sega Gamegear - " : "Sega Master System - ");
     strcat(window_title, filename);
-    if (!mfb_open(window_title, SMS_WIDTH, SMS_HEIGHT, scale))
+    if (!mfb_open(window_title, is_gamegear ? GG_VIEW_WIDTH : SMS_WIDTH, is_gamegear ? GG_VIEW_HEIGHT : SMS_HEIGHT, scale))
         return EXIT_FAILURE;
 
     key_status = (uint8_t *) mfb_keystatus();
 
     ym2413 = OPLL_new(3579545, SOUND_FREQUENCY);
     OPLL_reset(ym2413);
-    sn76489_reset();
+    sn76489 = SN76489_new(MASTER_CLOCK, SOUND_FREQUENCY);
+
+#ifdef HEADLESS
+    const int frames = argc > 2 ? atoi(argv[2]) : 3600;
 
-    CreateThread(NULL, 0, SoundThread, NULL, 0, NULL);
-    CreateThread(NULL, 0, TicksThread, NULL, 0, NULL);
+    if (argc > 3 && !(audio_sink = fopen(argv[3], "wb"))) {
+        printf("Can't open %s\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+#else
+    if (!audio_init()) printf("Can't open the sound device\n");
+#endif
 
 
     memset(RAM, 0, sizeof(RAM));
     memset(VRAM, 0, sizeof(VRAM));
+    vdp_init();
+    vdp_invalidate_tiles();
     ResetZ80(&cpu);
 
     memset(SCREEN, 255, SMS_WIDTH * SMS_HEIGHT);
 
-    mfb_set_pallete_array(sg1000_palette, 0, 16);
+    // MG_OUTPUT=rgba8888 or rgb565 additionally renders into vdp_output
+    const char *output = getenv("MG_OUTPUT");
+    if (output) {
+        if (strcmp(output, "rgba8888") == 0) vdp_output_format = OUTPUT_RGBA8888;
+        else if (strcmp(output, "rgb565") == 0) vdp_output_format = OUTPUT_RGB565;
+    }
+
+    for (uint8_t i = 0; i < 16; i++) {
+        vdp_set_color(i, sg1000_palette[i]);
+    }
+
+    batch_render = getenv("MG_BATCH") && atoi(getenv("MG_BATCH"));
+#ifdef RENDER_THREAD
+    if (getenv("MG_RENDER_THREAD") && atoi(getenv("MG_RENDER_THREAD")) && !is_sg1000) {
+        if (!render_start()) {
+            printf("Can't start the render thread\n");
+            return EXIT_FAILURE;
+        }
+        render_thread_enabled = batch_render = 1;
+    }
+#endif
 
     if (is_sg1000) {
         rom_slot1 = &RAM_BANK[0][0];
     }
+    memory_map();
+
+#ifdef PROFZ80
+    atexit(profile_report);
+#endif
+
+    const char *rewind_budget = getenv("MG_REWIND");
+    const size_t rewind_megabytes = rewind_budget ? strtoul(rewind_budget, NULL, 10) : REWIND_DEFAULT_BUDGET;
+    if (rewind_megabytes) {
+        if (!rewind_init(rewind_megabytes << 20)) {
+            printf("Can't allocate %zu MB for rewind\n", rewind_megabytes);
+            return EXIT_FAILURE;
+        }
+        rewind_enabled = 1;
+    }
 
-    for (int y = 192; y < SMS_HEIGHT; y++) {
+    // test pattern below the active area, the Game Gear window has none
+    for (int y = 192; y < SMS_HEIGHT && !is_gamegear; y++) {
         for (int x = 0; x < SMS_WIDTH; x++) {
             SCREEN[x + y * SMS_WIDTH] = (x / 16) + ((y / 16) & 1) * 16;
         }
@@ -494,9 +942,83 @@ int main(const int argc, char **argv) {
         frame_function = sms_frame;
     }
 
-    do {
+#ifdef HEADLESS
+    // Regression runs can start from and finish with a saved state
+    const char *load_state = getenv("MG_LOAD_STATE");
+    const char *save_state = getenv("MG_SAVE_STATE");
+    const char *screenshot = getenv("MG_SCREENSHOT");
+    // MG_VIDEO=<file> appends every drawn frame of vdp_output as raw video, needs MG_OUTPUT
+    const char *video_filename = getenv("MG_VIDEO");
+    FILE *video = NULL;
+    // MG_RENDER=0 draws only the last frame
+    const int render_last_only = getenv("MG_RENDER") && !atoi(getenv("MG_RENDER"));
+
+    if (load_state && !state_load_file(load_state)) {
+        printf("Can't load state from %s\n", load_state);
+        return EXIT_FAILURE;
+    }
+
+    if (video_filename && (vdp_output_format == OUTPUT_INDEXED || !(video = fopen(video_filename, "wb")))) {
+        printf("Can't write video to %s, MG_OUTPUT has to be rgba8888 or rgb565\n", video_filename);
+        return EXIT_FAILURE;
+    }
+
+    // No window to wait on, run frames back to back
+    for (int frame = 0; frame < frames; frame++) {
+        if (rewind_enabled) rewind_capture();
+        render_enabled = !render_last_only || frame == frames - 1;
         frame_function();
-    } while (mfb_update(SCREEN, 60) != -1);
+        audio_frame();
+        // the render thread delivers the previous frame
+        const int drawn = render_thread_enabled ? render_wait() : render_enabled;
+        mfb_update(SCREEN, 0);
+        if (video && drawn) write_video_frame(video);
+        render_submit();
+        speed_report();
+    }
+    if (render_wait() && video) write_video_frame(video);
+
+    if (audio_sink) fclose(audio_sink);
+    if (video) fclose(video);
+
+    if (screenshot && !save_screenshot(screenshot)) {
+        printf("Can't save screenshot to %s\n", screenshot);
+        return EXIT_FAILURE;
+    }
+
+    if (save_state && !state_save_file(save_state)) {
+        printf("Can't save state to %s\n", save_state);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+#else
+    for (uint32_t frame = 0;; frame++) {
+        if (rewind_enabled) {
+            if (rewinding) {
+                rewind_step();
+            } else {
+                rewind_capture();
+            }
+        }
+        frame_function();
+        // the sound card paces frames, the window's 60 fps limit only without a working sound device
+        const int paced = !turbo && audio_wait();
+        audio_frame();
+        render_wait();
+
+        if (turbo) {
+            speed_report();
+            if (frame % TURBO_FRAMESKIP) {
+                render_submit();
+                continue;
+            }
+        }
+
+        const int closed = mfb_update(SCREEN, turbo || paced ? 0 : 60) == -1;
+        render_submit();
+        if (closed) break;
+    }
 
     return EXIT_FAILURE;
+#endif
 }
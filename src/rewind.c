@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+#include "shared.h"
+#include "state.h"
+
+// History is bounded by the byte budget, this only caps the entry table
+#define REWIND_MAX_FRAMES (60 * 60 * 10)
+
+// Literal runs end at this many zero bytes, a run header costs 4
+#define RLE_MIN_ZEROS 4
+
+typedef struct {
+    size_t offset; // in ring
+    uint32_t size;
+    uint8_t keyframe;
+} rewind_entry;
+
+static uint8_t *ring;
+static size_t ring_size, ring_head, ring_used;
+
+static rewind_entry entries[REWIND_MAX_FRAMES];
+static uint32_t entry_first, entry_count;
+
+static size_t state_bytes, delta_bytes;
+static uint8_t *state, *delta, *previous, *packed;
+static size_t previous_size; // bytes of the last delta in previous[], the rest is zero
+static size_t keyframe_offset = SIZE_MAX; // ring offset of the keyframe the next delta builds on, SIZE_MAX if none
+static uint32_t since_keyframe;
+
+static double capture_seconds;
+static uint32_t captures;
+
+// Runs of zero bytes and literal bytes, each run pair prefixed by two uint16 lengths.
+// With base set the source is XORed against it, so unchanged bytes become zero runs
+static size_t rle_encode(const uint8_t *source, const uint8_t *base, const size_t size, uint8_t *destination) {
+    uint8_t *p = destination;
+    size_t i = 0;
+
+    while (i < size) {
+        uint16_t zeros = 0, literals = 0;
+
+        while (i < size && zeros < UINT16_MAX && (source[i] ^ (base ? base[i] : 0)) == 0) {
+            zeros++;
+            i++;
+        }
+
+        uint8_t *run = p + 4;
+        while (i < size && literals < UINT16_MAX) {
+            size_t end = i;
+            while (end < size && end - i < RLE_MIN_ZEROS && (source[end] ^ (base ? base[end] : 0)) == 0) end++;
+            if (end - i == RLE_MIN_ZEROS || (end == size && end > i)) break;
+
+            run[literals++] = source[i] ^ (base ? base[i] : 0);
+            i++;
+        }
+
+        memcpy(p, &zeros, 2);
+        memcpy(p + 2, &literals, 2);
+        p = run + literals;
+    }
+    return p - destination;
+}
+
+// Returns decoded bytes
+static size_t rle_decode(const uint8_t *source, const size_t size, const uint8_t *base, uint8_t *destination) {
+    const uint8_t *end = source + size;
+    size_t i = 0;
+
+    while (source < end) {
+        uint16_t zeros, literals;
+
+        memcpy(&zeros, source, 2);
+        memcpy(&literals, source + 2, 2);
+        source += 4;
+
+        if (base) {
+            memcpy(destination + i, base + i, zeros);
+        } else {
+            memset(destination + i, 0, zeros);
+        }
+        i += zeros;
+
+        for (uint16_t n = 0; n < literals; n++, i++) {
+            destination[i] = *source++ ^ (base ? base[i] : 0);
+        }
+    }
+    return i;
+}
+
+// Keep a delta as XOR base of the next one, NULL starts a chain. Deltas differ in length, past its end the base is zero
+static void rewind_previous(const uint8_t *source, const size_t size) {
+    if (source) memcpy(previous, source, size);
+    if (size < previous_size) memset(previous + size, 0, previous_size - size);
+    previous_size = size;
+}
+
+// Frames are useless without their keyframe, so the oldest keyframe goes together with them
+static void rewind_drop_oldest() {
+    do {
+        if (entries[entry_first].offset == keyframe_offset) keyframe_offset = SIZE_MAX;
+        ring_used -= entries[entry_first].size;
+        entry_first = (entry_first + 1) % REWIND_MAX_FRAMES;
+        entry_count--;
+    } while (entry_count && !entries[entry_first].keyframe);
+}
+
+// Make room for size contiguous bytes behind the newest entry, returns its ring offset
+static size_t rewind_allocate(const size_t size) {
+    if (entry_count == REWIND_MAX_FRAMES) rewind_drop_oldest();
+
+    if (ring_head + size > ring_size) {
+        // entries behind the head are the oldest ones, wrapping over them
+        while (entry_count && entries[entry_first].offset >= ring_head) rewind_drop_oldest();
+        ring_head = 0;
+    }
+    while (entry_count && entries[entry_first].offset >= ring_head && entries[entry_first].offset < ring_head + size) {
+        rewind_drop_oldest();
+    }
+
+    const size_t offset = ring_head;
+    ring_head += size;
+    return offset;
+}
+
+int rewind_init(const size_t budget) {
+    state_bytes = state_size();
+    delta_bytes = state_bytes + STATE_PAGES; // every page dirty: the full state plus an index byte per page
+    ring_size = budget;
+
+    ring = malloc(ring_size);
+    state = malloc(state_bytes);
+    delta = malloc(delta_bytes);
+    previous = calloc(delta_bytes, 1);
+    packed = malloc(delta_bytes * 2 + 16); // worst case of alternating literal and zero runs
+
+    return ring && state && delta && previous && packed;
+}
+
+void rewind_capture() {
+    const double start = host_seconds();
+    const int is_keyframe = since_keyframe == 0 || keyframe_offset == SIZE_MAX;
+    size_t size;
+
+    if (is_keyframe) {
+        state_delta_begin();
+        state_save(state);
+        size = rle_encode(state, NULL, state_bytes, packed);
+        rewind_previous(NULL, 0);
+    } else {
+        // only the pages written during the last frame, XOR against the delta before mostly leaves registers zero
+        const size_t delta_size = state_delta_save(delta);
+        size = rle_encode(delta, previous, delta_size, packed);
+        rewind_previous(delta, delta_size);
+    }
+
+    // a delta that is not stored breaks the chain, as does a budget smaller than one keyframe interval
+    // evicting the keyframe this frame depends on. Either way the next frame starts over with a keyframe
+    if (size > ring_size) {
+        keyframe_offset = SIZE_MAX;
+    } else {
+        const size_t offset = rewind_allocate(size);
+
+        if (is_keyframe || keyframe_offset != SIZE_MAX) {
+            memcpy(ring + offset, packed, size);
+            entries[(entry_first + entry_count++) % REWIND_MAX_FRAMES] = (rewind_entry){ offset, size, is_keyframe };
+            ring_used += size;
+
+            if (is_keyframe) keyframe_offset = offset;
+        }
+    }
+    since_keyframe = (since_keyframe + 1) % REWIND_KEYFRAME_INTERVAL;
+
+    capture_seconds += host_seconds() - start;
+    captures++;
+}
+
+int rewind_step() {
+    if (!entry_count) return 0;
+
+    const uint32_t newest_index = entry_first + entry_count - 1;
+    uint32_t index = newest_index;
+    while (!entries[index % REWIND_MAX_FRAMES].keyframe) index--;
+
+    // the keyframe, then every delta after it in capture order
+    const rewind_entry *entry = &entries[index % REWIND_MAX_FRAMES];
+    rle_decode(ring + entry->offset, entry->size, NULL, state);
+    int result = state_load(state, state_bytes);
+
+    rewind_previous(NULL, 0);
+    while (result && index != newest_index) {
+        entry = &entries[++index % REWIND_MAX_FRAMES];
+        const size_t size = rle_decode(ring + entry->offset, entry->size, previous, delta);
+        rewind_previous(delta, size);
+        result = state_delta_load(delta, size);
+    }
+
+    // the freed space is reused by the next capture, which starts a new keyframe
+    if (entry->offset == keyframe_offset) keyframe_offset = SIZE_MAX;
+    ring_head = entry->offset;
+    ring_used -= entry->size;
+    entry_count--;
+    since_keyframe = 0;
+
+    return result;
+}
+
+rewind_stats rewind_report() {
+    const rewind_stats stats = {
+        .frames = entry_count,
+        .used = ring_used,
+        .budget = ring_size,
+        .capture_seconds = capture_seconds,
+        .captures = captures,
+    };
+
+    capture_seconds = 0;
+    captures = 0;
+    return stats;
+}
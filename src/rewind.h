@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewind keeps the last frames of machine state in a ring buffer of a fixed byte budget. Every REWIND_KEYFRAME_INTERVAL
+// frame is stored as a run length encoded full state, the frames between as run length encoded XOR against that keyframe.
+// When the budget is used up the oldest keyframe is dropped together with its frames.
+#define REWIND_KEYFRAME_INTERVAL 60
+
+// Default budget in MB when MG_REWIND is not set, 0 turns rewind off
+#ifdef HEADLESS
+#define REWIND_DEFAULT_BUDGET 0
+#else
+#define REWIND_DEFAULT_BUDGET 32
+#endif
+
+// Allocate the ring, returns 0 when out of memory
+int rewind_init(size_t budget);
+
+// Store the machine state, call once per frame before running it
+void rewind_capture();
+
+// Restore the newest stored frame and drop it, returns 0 when history is empty
+int rewind_step();
+
+typedef struct {
+    uint32_t frames; // stored frames
+    size_t used; // compressed bytes in the ring
+    size_t budget;
+    double capture_seconds; // host time spent in rewind_capture()
+    uint32_t captures;
+} rewind_stats;
+
+// Counters since rewind_init(), capture_seconds and captures are reset by each call
+rewind_stats rewind_report();
@@ -1,4 +1,6 @@
 #pragma once
+#include <time.h>
+
 enum {
     BIT_15 = 1 << 15,
     BIT_14 = 1 << 14,
@@ -16,4 +18,11 @@ enum {
     BIT_2 = 1 << 2,
     BIT_1 = 1 << 1,
     BIT_0 = 1
-};
\ No newline at end of file
+};
+
+// Host wall clock in seconds, for speed and timing reports
+static inline double host_seconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
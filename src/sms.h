@@ -1,9 +1,11 @@
+#pragma once
 #include "shared.h"
 /* Display timing (NTSC) */
 #define MASTER_CLOCK        (3579545)
 #define LINES_PER_FRAME     (262)
 #define FRAMES_PER_SECOND   (60)
 #define CYCLES_PER_LINE     ((MASTER_CLOCK / FRAMES_PER_SECOND) / LINES_PER_FRAME)
+#define CYCLES_PER_FRAME    (CYCLES_PER_LINE * LINES_PER_FRAME)
 
 #define SMS_WIDTH 256
 #define SMS_HEIGHT 224
@@ -18,34 +18,14 @@
 // https://github.com/mamedev/mame/blob/master/src/devices/sound/sn76496.cpp
 // https://www.zeridajh.org/articles/me_sn76489_sound_chip_details/index.html
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "sn76489.h"
 /*
  *The SN76489 is connected to a clock signal, which is commonly 3579545Hz for NTSC systems and 3546893Hz for PAL/SECAM systems (these are based on the associated TV colour subcarrier frequencies, and are common master clock speeds for many systems). It divides this clock by 16 to get its internal clock. The datasheets specify a maximum of 4MHz.
 */
 
-#define BASE_INCREMENT (uint32_t) ((double) 3579545 * (1 << GETA_BITS) / (16 * SOUND_FREQUENCY));
 static const uint8_t parity[10] = { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0 };
-static uint32_t sn_count[3];
-static uint32_t volume[3];
-static uint32_t sn_[3];
-static uint32_t edge[3];
-static uint32_t mute[3];
-
-static uint32_t noise_seed;
-static uint32_t noise_count;
-static uint32_t noise_freq;
-static uint32_t noise_volume;
-static uint32_t noise_mode;
-static  uint32_t noise_fref;
-
-static uint32_t base_count;
-
-static uint32_t addr;
-
-static uint32_t stereo;
-
-static int16_t channel_sample[4];
-// } sng = { 0 };
 
 
 static const uint16_t volume_table[16] = {
@@ -54,115 +34,233 @@ static const uint16_t volume_table[16] = {
 
 #define GETA_BITS 24
 
-void sn76489_reset() {
+SN76489 *SN76489_new(const uint32_t clock, const uint32_t rate) {
+    SN76489 *sng = calloc(1, sizeof(SN76489));
+    if (sng == NULL)
+        return NULL;
+
+    sng->base_increment = (uint32_t) ((double) clock * (1 << GETA_BITS) / (16 * rate));
+    SN76489_reset(sng);
+    return sng;
+}
+
+void SN76489_delete(SN76489 *sng) {
+    free(sng);
+}
+
+void SN76489_reset(SN76489 *sng) {
     for (int i = 0; i < 3; i++) {
-        sn_count[i] = 0;
-        sn_[i] = 0;
-        edge[i] = 0;
-        volume[i] = 0x0f;
-        mute[i] = 0;
+        sng->sn_count[i] = 0;
+        sng->sn_[i] = 0;
+        sng->edge[i] = 0;
+        sng->volume[i] = 0x0f;
+        sng->mute[i] = 0;
     }
 
-    addr = 0;
+    sng->addr = 0;
 
-    noise_seed = 0x8000;
-    noise_count = 0;
-    noise_freq = 0;
-    noise_volume = 0x0f;
-    noise_mode = 0;
-    noise_fref = 0;
+    sng->noise_seed = 0x8000;
+    sng->noise_count = 0;
+    sng->noise_freq = 0;
+    sng->noise_volume = 0x0f;
+    sng->noise_mode = 0;
+    sng->noise_fref = 0;
 
-    stereo = 0xFF;
+    sng->stereo = 0xFF;
 
-    channel_sample[0] = channel_sample[1] = channel_sample[2] = channel_sample[3] = 0;
+    sng->channel_sample[0] = sng->channel_sample[1] = sng->channel_sample[2] = sng->channel_sample[3] = 0;
 }
 
-void sn76489_out(const uint16_t value) {
+void SN76489_write(SN76489 *sng, const uint8_t value) {
     if (value & 0x80) {
         //printf("OK");
-        addr = (value & 0x70) >> 4;
-        switch (addr) {
+        sng->addr = (value & 0x70) >> 4;
+        switch (sng->addr) {
             case 0: // tone 0: frequency
             case 2: // tone 1: frequency
             case 4: // tone 2: frequency
-                sn_[addr >> 1] = (sn_[addr >> 1] & 0x3F0) | (value & 0x0F);
+                sng->sn_[sng->addr >> 1] = (sng->sn_[sng->addr >> 1] & 0x3F0) | (value & 0x0F);
                 break;
 
             case 1: // tone 0: volume
             case 3: // tone 1: volume
             case 5: // tone 2: volume
-                volume[(addr - 1) >> 1] = value & 0xF;
+                sng->volume[(sng->addr - 1) >> 1] = value & 0xF;
                 break;
 
             case 6: // noise: frequency, mode
-                noise_mode = (value & 4) >> 2;
+                sng->noise_mode = (value & 4) >> 2;
 
                 if ((value & 0x03) == 0x03) {
-                    noise_freq = sn_[2];
-                    noise_fref = 1;
+                    sng->noise_freq = sng->sn_[2];
+                    sng->noise_fref = 1;
                 } else {
-                    noise_freq = 32 << (value & 0x03);
-                    noise_fref = 0;
+                    sng->noise_freq = 32 << (value & 0x03);
+                    sng->noise_fref = 0;
                 }
 
-                if (noise_freq == 0)
-                    noise_freq = 1;
+                if (sng->noise_freq == 0)
+                    sng->noise_freq = 1;
 
-                noise_seed = 0x8000;
+                sng->noise_seed = 0x8000;
                 break;
 
             case 7: // noise: volume
-                noise_volume = value & 0x0f;
+                sng->noise_volume = value & 0x0f;
                 break;
         }
-    } else {
-        sn_[addr >> 1] = ((value & 0x3F) << 4) | (sn_[addr >> 1] & 0x0F);
+    } else if (sng->addr < 6) { // the noise registers have no high bits, sn_[3] would be past the tones
+        sng->sn_[sng->addr >> 1] = ((value & 0x3F) << 4) | (sng->sn_[sng->addr >> 1] & 0x0F);
     }
 }
 
-int16_t sn76489_sample() {
-    base_count += BASE_INCREMENT;
-    const uint32_t incr = (base_count >> GETA_BITS);
-    base_count &= (1 << GETA_BITS) - 1;
-
-    /* Noise */
-    noise_count += incr;
-    if (noise_count & 0x400) {
-        if (noise_mode) /* White */
-            noise_seed = (noise_seed >> 1) | (parity[noise_seed & 0x0009] << 15);
-        else /* Periodic */
-            noise_seed = (noise_seed >> 1) | ((noise_seed & 1) << 15);
-
-        if (noise_fref)
-            noise_count -= sn_[2];
-        else
-            noise_count -= noise_freq;
-    }
+void SN76489_writeGGIO(SN76489 *sng, const uint8_t value) {
+    sng->stereo = value;
+}
+
+// Chip clocks run by the first k samples of a block starting at the fractional clock position base
+static inline uint32_t sn76489_clocks(const SN76489 *sng, const uint32_t base, const size_t k) {
+    return (uint32_t) ((base + (uint64_t) k * sng->base_increment) >> GETA_BITS);
+}
+
+// Sample from pos on at which a counter, holding count before sample pos, reaches 0x400
+static inline size_t sn76489_edge(const SN76489 *sng, const uint32_t base, const size_t pos, const uint32_t count) {
+    const uint64_t target = 0x400 - count + sn76489_clocks(sng, base, pos);
+    return ((target << GETA_BITS) - base + sng->base_increment - 1) / sng->base_increment - 1;
+}
 
-    if (noise_seed & 1) {
-        channel_sample[3] += volume_table[noise_volume] << 4;
+// Add a channel at a constant level to samples [from, to) through its output filter. Once the filter settled the
+// rest of the run adds a constant. sides: bit 0 the first, bit 1 the second of stride interleaved samples
+static inline void sn76489_run(int16_t *buffer, const size_t stride, const uint8_t sides, size_t from,
+                               const size_t to, const int16_t level, int16_t *filtered) {
+    int16_t sample = *filtered;
+
+    for (; from < to && (int16_t) ((sample + level) >> 1) != sample; from++) {
+        sample = (int16_t) ((sample + level) >> 1);
+        if (sides & 1) buffer[from * stride] += sample;
+        if (sides & 2) buffer[from * stride + 1] += sample;
+    }
+    if (sample) {
+        for (; from < to; from++) {
+            if (sides & 1) buffer[from * stride] += sample;
+            if (sides & 2) buffer[from * stride + 1] += sample;
+        }
     }
+    *filtered = sample;
+}
 
-    channel_sample[3] >>= 1;
+// Render tone channel 0-2 or noise 3 over samples. Runs between counter edges are computed, only periods shorter
+// than a sample's clocks and a counter out of range after a period change step sample by sample
+static void sn76489_channel(SN76489 *sng, const uint8_t channel, int16_t *buffer, const size_t stride, const uint8_t sides,
+                            const size_t samples) {
+    const uint8_t noise = channel == 3;
+    uint32_t *count = noise ? &sng->noise_count : &sng->sn_count[channel];
+    const uint32_t period = noise ? sng->noise_fref ? sng->sn_[2] : sng->noise_freq : sng->sn_[channel];
+    const int16_t volume_level = volume_table[noise ? sng->noise_volume : sng->volume[channel]] << 4;
+    int16_t *filtered = &sng->channel_sample[channel];
+    // most chip clocks a sample can take, longer periods change the edge at most once per sample
+    const uint32_t max_increment = (sng->base_increment >> GETA_BITS) + 1;
+
+    size_t pos = 0;
+    while (pos < samples) {
+        const uint8_t on = noise ? sng->noise_seed & 1 : sng->edge[channel] && !sng->mute[channel];
+        const int16_t level = on ? volume_level : 0;
+
+        size_t at;
+        if (!noise && period <= 1 && sng->edge[channel]) {
+            at = samples; // stays high
+        } else if (period > max_increment && *count < 0x400) {
+            at = sn76489_edge(sng, sng->base_count, pos, *count);
+        } else {
+            at = pos;
+        }
 
+        if (at >= samples) {
+            sn76489_run(buffer, stride, sides, pos, samples, level, filtered);
+            *count += sn76489_clocks(sng, sng->base_count, samples) - sn76489_clocks(sng, sng->base_count, pos);
+            return;
+        }
 
-    /* Tone */
-    for (int i = 0; i < 3; i++) {
-        sn_count[i] += incr;
-        if (sn_count[i] & 0x400) {
-            if (sn_[i] > 1) {
-                edge[i] = !edge[i];
-                sn_count[i] -= sn_[i];
+        sn76489_run(buffer, stride, sides, pos, at, level, filtered);
+        *count += sn76489_clocks(sng, sng->base_count, at + 1) - sn76489_clocks(sng, sng->base_count, pos);
+
+        if (*count & 0x400) {
+            if (noise) {
+                if (sng->noise_mode) /* White */
+                    sng->noise_seed = (sng->noise_seed >> 1) | (parity[sng->noise_seed & 0x0009] << 15);
+                else /* Periodic */
+                    sng->noise_seed = (sng->noise_seed >> 1) | ((sng->noise_seed & 1) << 15);
+                *count -= period;
+            } else if (period > 1) {
+                sng->edge[channel] = !sng->edge[channel];
+                *count -= period;
             } else {
-                edge[i] = 1;
+                sng->edge[channel] = 1;
             }
         }
 
-        if (edge[i] && !mute[i]) {
-            channel_sample[i] += volume_table[volume[i]] << 4;
-        }
+        const uint8_t edge_on = noise ? sng->noise_seed & 1 : sng->edge[channel] && !sng->mute[channel];
+        sn76489_run(buffer, stride, sides, at, at + 1, edge_on ? volume_level : 0, filtered);
+        pos = at + 1;
+    }
+}
+
+void SN76489_render(SN76489 *sng, int16_t *buffer, const size_t samples) {
+    memset(buffer, 0, samples * sizeof(int16_t));
 
-        channel_sample[i] >>= 1;
+    for (uint8_t channel = 0; channel < 4; channel++) {
+        sn76489_channel(sng, channel, buffer, 1, 1, samples);
     }
-    return (int16_t) (channel_sample[0] + channel_sample[1] + channel_sample[2] + channel_sample[3]);
+    sng->base_count = (uint32_t) (sng->base_count + (uint64_t) samples * sng->base_increment) & ((1 << GETA_BITS) - 1);
+}
+
+void SN76489_renderStereo(SN76489 *sng, int16_t *buffer, const size_t samples) {
+    memset(buffer, 0, samples * 2 * sizeof(int16_t));
+
+    for (uint8_t channel = 0; channel < 4; channel++) {
+        const uint8_t sides = (sng->stereo >> (channel + 4) & 1) | (sng->stereo >> channel & 1) << 1;
+        sn76489_channel(sng, channel, buffer, 2, sides, samples);
+    }
+    sng->base_count = (uint32_t) (sng->base_count + (uint64_t) samples * sng->base_increment) & ((1 << GETA_BITS) - 1);
+}
+
+// Every chip register and counter, in save state order
+#define SN76489_STATE \
+    X(sn_count) X(volume) X(sn_) X(edge) X(mute) \
+    X(noise_seed) X(noise_count) X(noise_freq) X(noise_volume) X(noise_mode) X(noise_fref) \
+    X(base_count) X(addr) X(stereo) X(channel_sample)
+
+size_t SN76489_stateSize(void) {
+    size_t size = 0;
+#define X(field) size += sizeof(((SN76489 *) NULL)->field);
+    SN76489_STATE
+#undef X
+    return size;
+}
+
+void SN76489_saveState(const SN76489 *sng, uint8_t *buffer) {
+#define X(field) memcpy(buffer, &sng->field, sizeof(sng->field)); buffer += sizeof(sng->field);
+    SN76489_STATE
+#undef X
+}
+
+int SN76489_checkState(const uint8_t *buffer) {
+    SN76489 state;
+#define X(field) memcpy(&state.field, buffer, sizeof(state.field)); buffer += sizeof(state.field);
+    SN76489_STATE
+#undef X
+
+    for (uint8_t channel = 0; channel < 3; channel++) {
+        if (state.volume[channel] > 0x0f) return 0;
+    }
+    return state.noise_volume <= 0x0f && state.addr <= 7;
+}
+
+int SN76489_loadState(SN76489 *sng, const uint8_t *buffer) {
+    if (!SN76489_checkState(buffer)) return 0;
+
+#define X(field) memcpy(&sng->field, buffer, sizeof(sng->field)); buffer += sizeof(sng->field);
+    SN76489_STATE
+#undef X
+    return 1;
 }
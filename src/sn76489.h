@@ -1,6 +1,51 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 #define SOUND_FREQUENCY 44100
 
-int16_t sn76489_sample();
-void sn76489_out(uint16_t value);
-void sn76489_reset();
+// SN76489 PSG, every chip is an instance like OPLL in emu2413.h
+typedef struct {
+    uint32_t sn_count[3];
+    uint32_t volume[3];
+    uint32_t sn_[3];
+    uint32_t edge[3];
+    uint32_t mute[3];
+
+    uint32_t noise_seed;
+    uint32_t noise_count;
+    uint32_t noise_freq;
+    uint32_t noise_volume;
+    uint32_t noise_mode;
+    uint32_t noise_fref;
+
+    uint32_t base_count;
+    uint32_t base_increment; // chip clocks per sample, fixed point
+
+    uint32_t addr;
+
+    uint32_t stereo;
+
+    int16_t channel_sample[4];
+} SN76489;
+
+// clock is the input clock, divided by 16 inside the chip, rate the sample rate
+SN76489 *SN76489_new(uint32_t clock, uint32_t rate);
+void SN76489_delete(SN76489 *sng);
+void SN76489_reset(SN76489 *sng);
+
+// Byte written to the chip's data port
+void SN76489_write(SN76489 *sng, uint8_t value);
+// Game Gear stereo register, port 0x06: bits 4-7 put channels 0-3 on the left, bits 0-3 on the right
+void SN76489_writeGGIO(SN76489 *sng, uint8_t value);
+
+// Render a block of mono samples, or interleaved left/right ones with the Game Gear stereo setting
+void SN76489_render(SN76489 *sng, int16_t *buffer, size_t samples);
+void SN76489_renderStereo(SN76489 *sng, int16_t *buffer, size_t samples);
+
+// Save state support: SN76489_saveState() writes SN76489_stateSize() bytes, SN76489_loadState() reads them back
+size_t SN76489_stateSize(void);
+void SN76489_saveState(const SN76489 *sng, uint8_t *buffer);
+// Returns 0 if a register in the state is out of range, volumes index a table
+int SN76489_checkState(const uint8_t *buffer);
+// Returns 0 and leaves the chip untouched if SN76489_checkState() fails
+int SN76489_loadState(SN76489 *sng, const uint8_t *buffer);
@@ -0,0 +1,54 @@
+#include "sound.h"
+#include "emu2413.h"
+
+extern OPLL *ym2413;
+extern SN76489 *sn76489;
+
+sound_write sound_queue[SOUND_QUEUE_SIZE];
+_Atomic uint32_t sound_queue_head, sound_queue_tail;
+uint32_t sound_cycles;
+
+static uint32_t rendered_cycles; // consumer side
+
+// PSG left/right straight into the interleaved output, FM is mono and goes to both sides
+static inline void sound_samples(int16_t *buffer, const size_t from, const size_t to) {
+    int16_t *samples = &buffer[from * 2];
+    SN76489_renderStereo(sn76489, samples, to - from);
+
+    for (size_t i = 0; i < to - from; i++) {
+        const int16_t fm = OPLL_calc(ym2413);
+
+        samples[i * 2] += fm;
+        samples[i * 2 + 1] += fm;
+    }
+}
+
+void sound_render(int16_t *buffer, const size_t samples, const uint32_t cycles) {
+    uint32_t tail = atomic_load_explicit(&sound_queue_tail, memory_order_relaxed);
+    const uint32_t head = atomic_load_explicit(&sound_queue_head, memory_order_acquire);
+
+    size_t sample = 0;
+    for (; tail != head; tail++) {
+        const sound_write *write = &sound_queue[tail & (SOUND_QUEUE_SIZE - 1)];
+        const uint32_t cycle = write->cycle - rendered_cycles;
+        if (cycle >= cycles) break; // a later block
+
+        const size_t at = (uint64_t) cycle * samples / cycles;
+        sound_samples(buffer, sample, at);
+        sample = at;
+
+        if (write->chip == SOUND_PSG) {
+            if (write->port == 0x06) {
+                SN76489_writeGGIO(sn76489, write->value);
+            } else {
+                SN76489_write(sn76489, write->value);
+            }
+        } else {
+            OPLL_writeIO(ym2413, write->port, write->value);
+        }
+    }
+    atomic_store_explicit(&sound_queue_tail, tail, memory_order_release);
+
+    sound_samples(buffer, sample, samples);
+    rendered_cycles += cycles;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sms.h"
+#include "sn76489.h"
+
+// PSG and FM writes from OutZ80() are not applied right away but queued with the Z80 cycle they happened at.
+// sound_render() applies them between samples while rendering, so every write lands on its sample. The queue is
+// single producer (the emulation) single consumer (the audio side) and needs no locking
+#define SOUND_QUEUE_SIZE 8192 // power of two, more than a frame of back to back OUTs
+
+enum SOUND_CHIP {
+    SOUND_PSG,
+    SOUND_FM,
+};
+
+typedef struct {
+    uint32_t cycle; // Z80 cycles since start
+    uint8_t chip;
+    uint8_t port;
+    uint8_t value;
+} sound_write;
+
+extern sound_write sound_queue[SOUND_QUEUE_SIZE];
+extern _Atomic uint32_t sound_queue_head, sound_queue_tail;
+extern uint32_t sound_cycles; // Z80 cycles of all frames before the running one, producer side
+
+// Queue a write at cycle within the running frame, a full queue drops it
+static inline void sound_queue_write(const uint32_t cycle, const uint8_t chip, const uint8_t port,
+                                     const uint8_t value) {
+    const uint32_t head = atomic_load_explicit(&sound_queue_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&sound_queue_tail, memory_order_acquire) == SOUND_QUEUE_SIZE) return;
+
+    sound_queue[head & (SOUND_QUEUE_SIZE - 1)] = (sound_write){
+        sound_cycles + (cycle < CYCLES_PER_FRAME ? cycle : CYCLES_PER_FRAME - 1), chip, port, value
+    };
+    atomic_store_explicit(&sound_queue_head, head + 1, memory_order_release);
+}
+
+// Called by the emulation after each frame, following writes are timestamped in the next one
+static inline void sound_frame_end() {
+    sound_cycles += CYCLES_PER_FRAME;
+}
+
+// Render samples stereo sample pairs into buffer covering the next cycles Z80 cycles, queued writes are applied at
+// the sample their cycle falls on
+void sound_render(int16_t *buffer, size_t samples, uint32_t cycles);
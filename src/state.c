@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu2413.h"
+#include "sn76489.h"
+#include "z80/Z80.h"
+
+#include "state.h"
+#include "vdp.h"
+
+extern Z80 cpu;
+extern OPLL *ym2413;
+extern SN76489 *sn76489;
+extern uint8_t ym2413_status;
+
+extern uint8_t RAM[8192];
+extern uint8_t ROM[1024 << 10];
+extern uint8_t RAM_BANK[2][16384];
+
+extern uint8_t *rom_slot1;
+extern uint8_t *rom_slot2;
+extern uint8_t *ram_rom_slot3;
+extern uint8_t slot3_is_ram;
+
+extern uint8_t is_sg1000;
+
+extern void memory_map();
+
+#define STATE_MAGIC "MGST"
+#define STATE_DELTA_MAGIC "MGSD"
+#define STATE_RAM_PAGE 0x80 // slot page index flag for RAM_BANK pages
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t machine;
+    uint32_t size;
+} state_header;
+
+uint8_t state_dirty[STATE_PAGES];
+
+static inline uint32_t state_machine() {
+    return is_gamegear | is_sg1000 << 1;
+}
+
+// Slot pointers are stored as ROM page or RAM_BANK index, offset is the slot base address
+static inline uint8_t slot_page(const uint8_t *slot, const uint16_t offset) {
+    const uint8_t *memory = slot + offset;
+
+    if (memory >= RAM_BANK[0] && memory < RAM_BANK[0] + sizeof(RAM_BANK)) {
+        return STATE_RAM_PAGE | (memory - &RAM_BANK[0][0]) / 16384;
+    }
+    return (memory - ROM) / 0x4000;
+}
+
+static inline uint8_t *slot_pointer(const uint8_t page, const uint16_t offset) {
+    uint8_t *memory = page & STATE_RAM_PAGE ? &RAM_BANK[page & 1][0] : ROM + (page & 0x3f) * 0x4000;
+    return memory - offset;
+}
+
+enum state_mode {
+    STATE_COUNT, // only sum up the size
+    STATE_SAVE,
+    STATE_LOAD,
+    STATE_CHECK, // walk a state to load, returns 0 if a field indexes a table or VRAM out of range
+};
+
+// Host memory behind a dirty page index
+static inline uint8_t *state_page(const uint8_t page) {
+    if (page >= STATE_VRAM_PAGE_INDEX) return &VRAM[(page - STATE_VRAM_PAGE_INDEX) << STATE_PAGE_SHIFT];
+    if (page >= STATE_RAM_BANK_PAGE_INDEX) return &RAM_BANK[0][(page - STATE_RAM_BANK_PAGE_INDEX) << STATE_PAGE_SHIFT];
+    return &RAM[(page - STATE_RAM_PAGE_INDEX) << STATE_PAGE_SHIFT];
+}
+
+// Copies every field to or from the buffer, returns bytes done. Without memory RAM, RAM_BANK and VRAM are skipped
+static size_t state_transfer(uint8_t *buffer, const enum state_mode mode, const int memory) {
+    const int save = mode == STATE_SAVE, load = mode == STATE_LOAD, check = mode == STATE_CHECK;
+    uint8_t *p = buffer;
+    uint8_t slots[3];
+
+#define FIELD(field) do { \
+        if (save) memcpy(p, &(field), sizeof(field)); \
+        if (load) memcpy(&(field), p, sizeof(field)); \
+        p += sizeof(field); \
+    } while (0)
+
+    // Z80, everything but the User pointer
+    FIELD(cpu.AF); FIELD(cpu.BC); FIELD(cpu.DE); FIELD(cpu.HL);
+    FIELD(cpu.IX); FIELD(cpu.IY); FIELD(cpu.PC); FIELD(cpu.SP);
+    FIELD(cpu.AF1); FIELD(cpu.BC1); FIELD(cpu.DE1); FIELD(cpu.HL1);
+    FIELD(cpu.IFF); FIELD(cpu.I); FIELD(cpu.R);
+    FIELD(cpu.IPeriod); FIELD(cpu.ICount); FIELD(cpu.IBackup);
+    FIELD(cpu.IRequest); FIELD(cpu.IAutoReset); FIELD(cpu.TrapBadOps);
+    FIELD(cpu.Trap); FIELD(cpu.Trace);
+
+    // Memory and mapper
+    if (memory) {
+        FIELD(RAM);
+        FIELD(RAM_BANK);
+    }
+    if (save) {
+        slots[0] = slot_page(rom_slot1, 0);
+        slots[1] = slot_page(rom_slot2, 0x4000);
+        slots[2] = slot_page(ram_rom_slot3, 0x8000);
+    }
+    FIELD(slots);
+    if (load) {
+        rom_slot1 = slot_pointer(slots[0], 0);
+        rom_slot2 = slot_pointer(slots[1], 0x4000);
+        ram_rom_slot3 = slot_pointer(slots[2], 0x8000);
+    }
+    FIELD(slot3_is_ram);
+
+    // VDP, table pointers are rebuilt from registers
+    if (memory) FIELD(VRAM);
+    FIELD(scanline);
+    FIELD(vdp.status); FIELD(vdp.latch); FIELD(vdp.read_buffer);
+    if (check) {
+        uint16_t address;
+        memcpy(&address, p, sizeof(address));
+        if (address > VRAM_SIZE_WRAP) return 0; // data port accesses index VRAM before wrapping
+    }
+    FIELD(vdp.address); FIELD(vdp.code);
+    FIELD(vdp.control_word); FIELD(vdp.color_latch);
+    FIELD(vdp.CRAM);
+    FIELD(vdp.registers);
+
+    // Sound
+    if (save) SN76489_saveState(sn76489, p);
+    if (load) SN76489_loadState(sn76489, p);
+    if (check && !SN76489_checkState(p)) return 0;
+    p += SN76489_stateSize();
+    if (save) OPLL_saveState(ym2413, p);
+    if (load) OPLL_loadState(ym2413, p);
+    if (check && !OPLL_checkState(p)) return 0;
+    p += OPLL_stateSize();
+    FIELD(ym2413_status);
+
+#undef FIELD
+    return p - buffer;
+}
+
+size_t state_size() {
+    return sizeof(state_header) + state_transfer(NULL, STATE_COUNT, 1);
+}
+
+static inline void state_header_write(uint8_t *buffer, const char *magic, const size_t size) {
+    state_header header = { .version = STATE_VERSION, .machine = state_machine(), .size = size };
+
+    memcpy(header.magic, magic, sizeof(header.magic));
+    memcpy(buffer, &header, sizeof(header));
+}
+
+static inline int state_header_valid(const uint8_t *buffer, const char *magic, const size_t size) {
+    state_header header;
+
+    if (size < sizeof(header)) return 0;
+    memcpy(&header, buffer, sizeof(header));
+    return memcmp(header.magic, magic, sizeof(header.magic)) == 0 && header.version == STATE_VERSION &&
+           header.machine == state_machine() && header.size == size;
+}
+
+// Rebuild everything derived from the restored fields. Memory changed behind the page flags,
+// so every page goes into the next delta
+static void state_loaded() {
+    memory_map();
+    vdp_update_tables();
+    vdp_invalidate_tiles();
+    if (!is_sg1000) vdp_update_palette();
+    memset(state_dirty, 1, sizeof(state_dirty));
+}
+
+size_t state_save(uint8_t *buffer) {
+    state_header_write(buffer, STATE_MAGIC, state_size());
+    return sizeof(state_header) + state_transfer(buffer + sizeof(state_header), STATE_SAVE, 1);
+}
+
+int state_load(const uint8_t *buffer, const size_t size) {
+    if (size != state_size() || !state_header_valid(buffer, STATE_MAGIC, size)) return 0;
+    if (!state_transfer((uint8_t *) buffer + sizeof(state_header), STATE_CHECK, 1)) return 0;
+
+    state_transfer((uint8_t *) buffer + sizeof(state_header), STATE_LOAD, 1);
+    state_loaded();
+    return 1;
+}
+
+void state_delta_begin() {
+    memset(state_dirty, 0, sizeof(state_dirty));
+}
+
+// Delta layout: header, registers, then page index byte and STATE_PAGE_SIZE bytes for every dirty page
+size_t state_delta_size() {
+    size_t size = sizeof(state_header) + state_transfer(NULL, STATE_COUNT, 0);
+
+    for (uint8_t page = 0; page < STATE_PAGES; page++) {
+        if (state_dirty[page]) size += 1 + STATE_PAGE_SIZE;
+    }
+    return size;
+}
+
+size_t state_delta_save(uint8_t *buffer) {
+    uint8_t *p = buffer + sizeof(state_header);
+
+    p += state_transfer(p, STATE_SAVE, 0);
+    for (uint8_t page = 0; page < STATE_PAGES; page++) {
+        if (state_dirty[page]) {
+            state_dirty[page] = 0;
+            *p++ = page;
+            memcpy(p, state_page(page), STATE_PAGE_SIZE);
+            p += STATE_PAGE_SIZE;
+        }
+    }
+
+    state_header_write(buffer, STATE_DELTA_MAGIC, p - buffer);
+    return p - buffer;
+}
+
+int state_delta_load(const uint8_t *buffer, const size_t size) {
+    const size_t registers_size = sizeof(state_header) + state_transfer(NULL, STATE_COUNT, 0);
+
+    if (size < registers_size || (size - registers_size) % (1 + STATE_PAGE_SIZE) ||
+        !state_header_valid(buffer, STATE_DELTA_MAGIC, size)) {
+        return 0;
+    }
+    for (const uint8_t *p = buffer + registers_size; p < buffer + size; p += 1 + STATE_PAGE_SIZE) {
+        if (*p >= STATE_PAGES) return 0;
+    }
+    if (!state_transfer((uint8_t *) buffer + sizeof(state_header), STATE_CHECK, 0)) return 0;
+
+    state_transfer((uint8_t *) buffer + sizeof(state_header), STATE_LOAD, 0);
+    for (const uint8_t *p = buffer + registers_size; p < buffer + size; p += 1 + STATE_PAGE_SIZE) {
+        memcpy(state_page(*p), p + 1, STATE_PAGE_SIZE);
+    }
+    state_loaded();
+    return 1;
+}
+
+int state_save_file(const char *filename) {
+    const size_t size = state_size();
+    uint8_t *buffer = malloc(size);
+    FILE *file = fopen(filename, "wb");
+    int result = 0;
+
+    if (buffer && file) {
+        state_save(buffer);
+        result = fwrite(buffer, 1, size, file) == size;
+    }
+    if (file) fclose(file);
+    free(buffer);
+    return result;
+}
+
+int state_load_file(const char *filename) {
+    const size_t size = state_size();
+    uint8_t *buffer = malloc(size);
+    FILE *file = fopen(filename, "rb");
+    int result = 0;
+
+    // read one byte more than expected to catch oversized files
+    if (buffer && file) {
+        const size_t read = fread(buffer, 1, size, file);
+        result = read == size && fgetc(file) == EOF && state_load(buffer, size);
+    }
+    if (file) fclose(file);
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Save states hold the whole machine between two frames. Mapper slots are stored as page indices,
+// so a state can be loaded into another process running the same ROM.
+#define STATE_VERSION 2
+
+// Copy-on-write page tracking for delta states: every 1KB page of RAM, RAM_BANK and VRAM gets a flag,
+// set by WrZ80() and vdp_write() on the first write since the previous delta
+#define STATE_PAGE_SHIFT 10
+#define STATE_PAGE_SIZE (1 << STATE_PAGE_SHIFT)
+
+#define STATE_RAM_PAGE_INDEX 0
+#define STATE_RAM_BANK_PAGE_INDEX (STATE_RAM_PAGE_INDEX + (8192 >> STATE_PAGE_SHIFT))
+#define STATE_VRAM_PAGE_INDEX (STATE_RAM_BANK_PAGE_INDEX + (2 * 16384 >> STATE_PAGE_SHIFT))
+#define STATE_PAGES (STATE_VRAM_PAGE_INDEX + (16384 >> STATE_PAGE_SHIFT))
+
+extern uint8_t state_dirty[STATE_PAGES];
+
+// Bytes written by state_save()
+size_t state_size();
+
+// Serialize the machine into buffer, returns state_size()
+size_t state_save(uint8_t *buffer);
+
+// Restore a state written by state_save(), returns 0 if it is corrupt, of another version or machine
+int state_load(const uint8_t *buffer, size_t size);
+
+// Delta states are full states without the memory pages that were not written since the previous delta.
+// A chain starts with state_delta_begin() and state_save(), deltas are loaded in order on top of it.
+// state_save() leaves the page flags alone, a load marks every page, so the delta after it holds all memory.
+
+// Clear the page flags, the next delta only holds pages written from now on
+void state_delta_begin();
+
+// Bytes the next state_delta_save() will write
+size_t state_delta_size();
+
+// Serialize registers and dirty pages only, returns state_delta_size()
+size_t state_delta_save(uint8_t *buffer);
+
+// Apply a delta on top of the state it was taken after, returns 0 if it is corrupt, of another version or machine
+int state_delta_load(const uint8_t *buffer, size_t size);
+
+int state_save_file(const char *filename);
+int state_load_file(const char *filename);
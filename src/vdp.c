@@ -1,11 +1,32 @@
 #include "vdp.h"
 
-uint16_t scanline = 0;
-uint8_t VRAM[VRAM_SIZE]= { 0 };
+VDP_LOCAL uint16_t scanline = 0;
+VDP_LOCAL uint8_t VRAM[VRAM_SIZE]= { 0 };
 
-VDP vdp = {
-    .nametable = &VRAM[0x3800],
-    .sprites = &VRAM[0x3C00],
+VDP_LOCAL uint64_t vdp_tiles[TILE_COUNT][8];
+VDP_LOCAL uint8_t vdp_tile_dirty[TILE_COUNT];
+VDP_LOCAL uint16_t vdp_dirty_tiles[TILE_COUNT];
+VDP_LOCAL uint16_t vdp_dirty_count = 0;
+
+VDP_LOCAL uint8_t vdp_line_sprites[192][SPRITES_PER_LINE];
+VDP_LOCAL uint8_t vdp_line_sprite_count[192];
+VDP_LOCAL uint8_t vdp_line_overflow[192];
+VDP_LOCAL uint8_t vdp_sprites_height = 0;
+
+uint8_t vdp_output_format = OUTPUT_INDEXED;
+uint32_t vdp_output_lut[32];
+uint32_t vdp_output[VDP_OUTPUT_WIDTH * VDP_OUTPUT_HEIGHT];
+
+uint16_t vdp_view_x = 0, vdp_view_y = 0, vdp_view_width = VDP_OUTPUT_WIDTH, vdp_view_height = VDP_OUTPUT_HEIGHT;
+
+VDP_LOCAL vdp_event vdp_log[VDP_LOG_SIZE];
+VDP_LOCAL uint16_t vdp_log_count = 0;
+VDP_LOCAL uint8_t vdp_log_overflow = 0;
+VDP_LOCAL uint8_t vdp_log_vram = 0;
+VDP_LOCAL uint8_t vdp_line_registers[11];
+VDP_LOCAL uint32_t vdp_line_lut[32];
+
+VDP_LOCAL VDP vdp = {
     .registers = {
         0x04,
         0x20,
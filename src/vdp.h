@@ -1,14 +1,44 @@
 #pragma once
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "shared.h"
+#include "state.h"
 
 #include "win32/MiniFB.h"
 
+// Built with RENDER_THREAD every thread has its own VDP state, VRAM and render caches, so a render thread can draw
+// a frame from a snapshot while the emulation thread runs the next one
+#ifdef RENDER_THREAD
+#define VDP_LOCAL _Thread_local
+#else
+#define VDP_LOCAL
+#endif
+
 #define VRAM_SIZE 16384
 #define VRAM_SIZE_WRAP (VRAM_SIZE - 1)
 
+#define TILE_COUNT 512 // 32 byte Mode 4 patterns filling VRAM
+
+#define SPRITE_COUNT 64
+#define SPRITES_PER_LINE 8
+#define SPRITE_TERMINATOR 208 // Y of the first sprite not displayed anymore
+
+#define VDP_OUTPUT_WIDTH 256
+#define VDP_OUTPUT_HEIGHT 192
+
+// Game Gear LCD window into the 256x192 display
+#define GG_VIEW_X 48
+#define GG_VIEW_Y 24
+#define GG_VIEW_WIDTH 160
+#define GG_VIEW_HEIGHT 144
+
+// CPU slices start where the line interrupt fires, at the end of a line's active area. Right border, blanking and
+// left border, 86 of the 342 pixels of 2/3 CPU cycle each, pass before the next line's first pixel.
+#define VDP_HBLANK_CYCLES ((342 - 256) * 2 / 3)
+#define VDP_LOG_SIZE 8192 // a whole frame of VRAM writes in batched rendering
+
 enum STATUS {
     VDP_VSYNC_PENDING = BIT_7,
     VDP_SPRITE_OVERFLOW = BIT_6,
@@ -80,6 +110,9 @@ typedef struct {
     uint16_t address;
     uint16_t code;
 
+    uint16_t control_word;
+    uint16_t color_latch; /* GG only */
+
     uint8_t *nametable;
     uint8_t *sprites;
 
@@ -106,6 +139,28 @@ static const uint32_t sg1000_palette[16] = {
     0xcccccc,
     0xffffff,
 };
+
+// Mode 4 planar to chunky conversion: every bit of a pattern byte spread into its own byte of an uint64_t,
+// in screen order once stored to memory. OR-ing the four plane bytes shifted by their plane number gives
+// the 8 palette indexes of a pattern row.
+#define PLANAR_ONES 0x0101010101010101ULL
+#define PLANAR_SPREAD(plane, mask) (((((plane) * PLANAR_ONES) & (mask)) + 0x7F7F7F7F7F7F7F7FULL) >> 7 & PLANAR_ONES)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PLANAR_MASK 0x8040201008040201ULL
+#define PLANAR_GATHER 0x8040201008040201ULL
+#else
+#define PLANAR_MASK 0x0102040810204080ULL
+#define PLANAR_GATHER 0x0102040810204080ULL
+#endif
+
+#define PLANAR_2(n, mask) PLANAR_SPREAD(n, mask), PLANAR_SPREAD((n) + 1, mask)
+#define PLANAR_8(n, mask) PLANAR_2(n, mask), PLANAR_2((n) + 2, mask), PLANAR_2((n) + 4, mask), PLANAR_2((n) + 6, mask)
+#define PLANAR_32(n, mask) PLANAR_8(n, mask), PLANAR_8((n) + 8, mask), PLANAR_8((n) + 16, mask), PLANAR_8((n) + 24, mask)
+#define PLANAR_256(mask) PLANAR_32(0, mask), PLANAR_32(32, mask), PLANAR_32(64, mask), PLANAR_32(96, mask), \
+    PLANAR_32(128, mask), PLANAR_32(160, mask), PLANAR_32(192, mask), PLANAR_32(224, mask)
+
+static const uint64_t planar_to_chunky[256] = { PLANAR_256(PLANAR_MASK) };
+
 /* Return values from the V counter */
 static const uint8_t vcnt[262] =
 {
@@ -156,12 +211,78 @@ static const uint8_t hcnt[343] =
 };
 
 
-extern VDP vdp;
-extern uint8_t VRAM[VRAM_SIZE];
-extern uint16_t scanline;
+extern VDP_LOCAL VDP vdp;
+extern VDP_LOCAL uint8_t VRAM[VRAM_SIZE];
+extern VDP_LOCAL uint16_t scanline;
 
 extern uint8_t is_gamegear;
 
+// Every pattern row decoded by vdp_pattern_row(), byte swapping a row flips it horizontally.
+// VRAM writes queue their tile, vdp_update_tiles() decodes the queued ones again before a line is rendered.
+extern VDP_LOCAL uint64_t vdp_tiles[TILE_COUNT][8];
+extern VDP_LOCAL uint8_t vdp_tile_dirty[TILE_COUNT];
+extern VDP_LOCAL uint16_t vdp_dirty_tiles[TILE_COUNT];
+extern VDP_LOCAL uint16_t vdp_dirty_count;
+
+// Mode 4 sprites of every active line, in SAT order, built by vdp_update_sprites() whenever SAT Y coordinates,
+// its base address or the sprite height changed. X and pattern are still read from the SAT while rendering.
+extern VDP_LOCAL uint8_t vdp_line_sprites[192][SPRITES_PER_LINE];
+extern VDP_LOCAL uint8_t vdp_line_sprite_count[192];
+extern VDP_LOCAL uint8_t vdp_line_overflow[192]; // more than SPRITES_PER_LINE sprites wanted on the line
+extern VDP_LOCAL uint8_t vdp_sprites_height; // sprite height the table holds, 0 if it has to be rebuilt
+
+// Optional direct color output for encoders and non-GDI backends. With vdp_output_format set every rendered line
+// of SCREEN is also stored through vdp_output_lut into vdp_output, RGBA8888 in memory order or native RGB565.
+// The LUT follows CRAM writes, so no palette pass over the whole frame is needed.
+enum OUTPUT_FORMAT {
+    OUTPUT_INDEXED, // SCREEN and the host palette only
+    OUTPUT_RGBA8888,
+    OUTPUT_RGB565,
+};
+
+extern uint8_t vdp_output_format;
+extern uint32_t vdp_output_lut[32];
+extern uint32_t vdp_output[VDP_OUTPUT_WIDTH * VDP_OUTPUT_HEIGHT]; // RGB565 uses the first half as uint16_t
+
+// Part of the display that is rendered, SCREEN and vdp_output hold vdp_view_width pixels per line.
+// The whole display on SMS, the LCD window on Game Gear
+extern uint16_t vdp_view_x, vdp_view_y, vdp_view_width, vdp_view_height;
+
+static inline uint8_t vdp_line_visible(const uint16_t line) {
+    return (uint16_t) (line - vdp_view_y) < vdp_view_height;
+}
+
+// Register and CRAM writes timestamped with the line and pixel they take effect on, so renderers can apply them
+// mid-line. The log starts over with vdp_log_flush(), vdp_line_registers and vdp_line_lut keep the state from
+// before the logged writes. Writes beyond VDP_LOG_SIZE are not split but still take effect on the next line.
+// With vdp_log_vram set VRAM writes are logged too, so a frame can be rendered after its CPU has run.
+enum VDP_EVENT {
+    VDP_EVENT_REGISTER,
+    VDP_EVENT_COLOR,
+    VDP_EVENT_VRAM, // value holds address, new byte << 16 and old byte << 24
+};
+
+typedef struct {
+    uint16_t line;
+    uint16_t pixel; // 0 if written before the line started, VDP_OUTPUT_WIDTH after it ended
+    uint8_t type;
+    uint8_t index; // register or palette entry
+    uint32_t value; // register value or host RGB
+} vdp_event;
+
+extern VDP_LOCAL vdp_event vdp_log[VDP_LOG_SIZE];
+extern VDP_LOCAL uint16_t vdp_log_count;
+extern VDP_LOCAL uint8_t vdp_log_overflow;
+extern VDP_LOCAL uint8_t vdp_log_vram;
+extern VDP_LOCAL uint8_t vdp_line_registers[11];
+extern VDP_LOCAL uint32_t vdp_line_lut[32];
+
+// Power on table addresses, a thread local VDP can not have them in its initializer
+static inline void vdp_init() {
+    vdp.nametable = &VRAM[0x3800];
+    vdp.sprites = &VRAM[0x3C00];
+}
+
 static inline uint8_t vdp_hcounter(const uint16_t pixel) {
     return hcnt[pixel >> 1 & 0x1FF];
 }
@@ -170,12 +291,112 @@ static inline uint8_t vdp_vcounter() {
     return vcnt[scanline];
 }
 
-inline void vdp_increment_address() {
+// 8 palette indexes of the 4 bitplanes at pattern
+static inline uint64_t vdp_pattern_row(const uint8_t *pattern) {
+    return planar_to_chunky[pattern[0]] | planar_to_chunky[pattern[1]] << 1 |
+           planar_to_chunky[pattern[2]] << 2 | planar_to_chunky[pattern[3]] << 3;
+}
+
+// 1 in every byte of a pattern row that is not transparent
+static inline uint64_t vdp_pattern_opaque(const uint64_t row) {
+    return (row | row >> 1 | row >> 2 | row >> 3) & PLANAR_ONES;
+}
+
+// Opaque pixels of a pattern row as bits, leftmost pixel in bit 0
+static inline uint8_t vdp_pattern_mask(const uint64_t row) {
+    return vdp_pattern_opaque(row) * PLANAR_GATHER >> 56;
+}
+
+static inline void vdp_invalidate_tile(const uint16_t tile) {
+    if (!vdp_tile_dirty[tile]) {
+        vdp_tile_dirty[tile] = 1;
+        vdp_dirty_tiles[vdp_dirty_count++] = tile;
+    }
+}
+
+// Whole VRAM replaced, e.g. reset or loaded state
+static inline void vdp_invalidate_tiles() {
+    for (uint16_t tile = 0; tile < TILE_COUNT; tile++) {
+        vdp_invalidate_tile(tile);
+    }
+    vdp_sprites_height = 0;
+}
+
+static inline void vdp_update_tiles() {
+    while (vdp_dirty_count) {
+        const uint16_t tile = vdp_dirty_tiles[--vdp_dirty_count];
+        const uint8_t *pattern = &VRAM[tile * 32];
+
+        vdp_tile_dirty[tile] = 0;
+        for (uint8_t row = 0; row < 8; row++, pattern += 4) {
+            vdp_tiles[tile][row] = vdp_pattern_row(pattern);
+        }
+    }
+}
+
+static inline void vdp_update_sprites(const uint8_t sprite_height) {
+    if (vdp_sprites_height == sprite_height) return;
+
+    memset(vdp_line_sprite_count, 0, sizeof(vdp_line_sprite_count));
+    memset(vdp_line_overflow, 0, sizeof(vdp_line_overflow));
+
+    for (uint8_t sprite_index = 0; sprite_index < SPRITE_COUNT; sprite_index++) {
+        const uint8_t sprite_y = vdp.sprites[sprite_index];
+        if (sprite_y == SPRITE_TERMINATOR) break;
+
+        for (uint16_t line = sprite_y; line < sprite_y + sprite_height && line < 192; line++) {
+            if (vdp_line_sprite_count[line] < SPRITES_PER_LINE) {
+                vdp_line_sprites[line][vdp_line_sprite_count[line]++] = sprite_index;
+            } else {
+                vdp_line_overflow[line] = 1;
+            }
+        }
+    }
+    vdp_sprites_height = sprite_height;
+}
+
+// Decoded pattern row of a sprite on line, pattern_base is 0 or 256 as selected by register 6.
+// 8x16 sprites continue into the next tile
+static inline uint64_t vdp_sprite_row(const uint8_t sprite_index, const uint8_t line, const uint16_t pattern_base) {
+    const uint8_t sprite_row = line - vdp.sprites[sprite_index];
+    const uint16_t tile_index = pattern_base + vdp.sprites[128 + sprite_index * 2 + 1] + (sprite_row >> 3);
+
+    return vdp_tiles[tile_index & (TILE_COUNT - 1)][sprite_row & 7];
+}
+
+// Raise VDP_SPRITE_COLLISION when opaque pixels of two sprites on line overlap inside the 256 visible pixels.
+// Sprites are OR-ed into a bit per pixel mask, 8 pixels left of the screen for shifted sprites and 8 right of it
+// for the overrun, so every sprite costs a couple of word ANDs.
+static inline void vdp_sprite_collision(const uint8_t line, const uint8_t hshift, const uint16_t pattern_base) {
+    static const uint64_t visible[6] = { ~0xFFULL, ~0ULL, ~0ULL, ~0ULL, 0xFF, 0 };
+    uint64_t occupied[6] = { 0 };
+
+    if (vdp.status & VDP_SPRITE_COLLISION || vdp_line_sprite_count[line] < 2) return;
+
+    for (uint8_t sprite = 0; sprite < vdp_line_sprite_count[line]; sprite++) {
+        const uint8_t sprite_index = vdp_line_sprites[line][sprite];
+        const uint16_t x = vdp.sprites[128 + sprite_index * 2] - hshift + 8;
+        const uint8_t word = x >> 6, shift = x & 63;
+
+        const uint64_t mask = vdp_pattern_mask(vdp_sprite_row(sprite_index, line, pattern_base));
+        const uint64_t low = mask << shift & visible[word];
+        const uint64_t high = (shift ? mask >> (64 - shift) : 0) & visible[word + 1];
+
+        if (occupied[word] & low || occupied[word + 1] & high) {
+            vdp.status |= VDP_SPRITE_COLLISION;
+            return;
+        }
+        occupied[word] |= low;
+        occupied[word + 1] |= high;
+    }
+}
+
+static inline void vdp_increment_address() {
     vdp.address++;
     vdp.address &= VRAM_SIZE_WRAP;
 }
 
-inline uint8_t vdp_read_byte() {
+static inline uint8_t vdp_read_byte() {
     const uint8_t result = VRAM[vdp.address];
     vdp_increment_address();
     return result;
@@ -188,9 +409,144 @@ static inline uint8_t vdp_read() {
     return result;
 }
 
-static inline void vdp_write(const uint8_t reg, const uint8_t value) {
-    static uint16_t control_word;
+// Point nametable and sprite attribute table at VRAM as set by registers 2 and 5
+static inline void vdp_update_tables() {
+    vdp.nametable = &VRAM[(vdp.registers[R2_NAMETABLE_BASE_ADDRESS] << 10) & 0x3800];
+    uint8_t *sprites = &VRAM[(vdp.registers[R5_SPRITE_ATTRIBUTE_TABLE_BASE_ADDRESS] << 7) & 0x3F00];
+    if (vdp.sprites != sprites) {
+        vdp.sprites = sprites;
+        vdp_sprites_height = 0;
+    }
+    // vdp.sprites += vdp.registers[R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS] & BIT_2 ? 256 : 0; // 256 or 0
+}
+
+// Host RGB in vdp_output_format
+static inline uint32_t vdp_output_color(const uint32_t color) {
+    const uint8_t r = color >> 16, g = color >> 8, b = color;
+
+    if (vdp_output_format == OUTPUT_RGB565) {
+        return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+    }
+    uint32_t rgba;
+    memcpy(&rgba, (uint8_t[4]){ r, g, b, 0xFF }, 4);
+    return rgba;
+}
+
+// Host palette entry and its output LUT entry
+static inline void vdp_set_color(const uint8_t index, const uint32_t color) {
+    mfb_set_pallete(index, color);
+    vdp_output_lut[index] = vdp_output_color(color);
+}
+
+static inline void vdp_output_span(const uint8_t *pixels, const uint8_t line, const uint16_t from, const uint16_t to,
+                                   const uint32_t *lut) {
+    if (vdp_output_format == OUTPUT_RGBA8888) {
+        uint32_t *output = &vdp_output[line * vdp_view_width];
+
+        for (int x = from; x < to; x++) {
+            output[x] = lut[pixels[x] & 31];
+        }
+    } else {
+        uint16_t *output = (uint16_t *) vdp_output + line * vdp_view_width;
+
+        for (int x = from; x < to; x++) {
+            output[x] = lut[pixels[x] & 31];
+        }
+    }
+}
+
+// Store a rendered SCREEN line, line and pixels in view coordinates, into vdp_output. CRAM writes among the line's
+// events switch colors at their pixel
+static inline void vdp_output_line(const uint8_t *pixels, const uint8_t line, const vdp_event *events,
+                                   const uint16_t count) {
+    if (vdp_output_format == OUTPUT_INDEXED) return;
+
+    uint32_t lut[32];
+    memcpy(lut, vdp_line_lut, sizeof(lut));
+
+    uint16_t x = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        if (events[i].type != VDP_EVENT_COLOR) continue;
+
+        const int pixel = events[i].pixel - vdp_view_x;
+        if (pixel > x) {
+            const uint16_t to = pixel < vdp_view_width ? pixel : vdp_view_width;
+            vdp_output_span(pixels, line, x, to, lut);
+            x = to;
+        }
+        lut[events[i].index] = vdp_output_color(events[i].value);
+    }
+    vdp_output_span(pixels, line, x, vdp_view_width, lut);
+}
 
+// Start a new log, the current registers and colors become the line start state
+static inline void vdp_log_flush() {
+    vdp_log_count = 0;
+    vdp_log_overflow = 0;
+    memcpy(vdp_line_registers, vdp.registers, sizeof(vdp_line_registers));
+    memcpy(vdp_line_lut, vdp_output_lut, sizeof(vdp_line_lut));
+}
+
+// Move the line start state past events, for renderers replaying a log of several lines
+static inline void vdp_log_apply(const vdp_event *events, const uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        if (events[i].type == VDP_EVENT_REGISTER) {
+            vdp_line_registers[events[i].index] = events[i].value;
+        } else if (events[i].type == VDP_EVENT_COLOR) {
+            vdp_line_lut[events[i].index] = vdp_output_color(events[i].value);
+        }
+    }
+}
+
+// Put logged VRAM writes back, undo restores the bytes they replaced
+static inline void vdp_log_vram_replay(const vdp_event *events, const uint16_t count, const uint8_t undo) {
+    for (uint16_t n = 0; n < count; n++) {
+        const vdp_event *event = &events[undo ? count - 1 - n : n];
+        if (event->type != VDP_EVENT_VRAM) continue;
+
+        const uint16_t address = event->value & VRAM_SIZE_WRAP;
+        VRAM[address] = event->value >> (undo ? 24 : 16);
+        vdp_invalidate_tile(address >> 5);
+        if ((uint16_t) (&VRAM[address] - vdp.sprites) < SPRITE_COUNT) vdp_sprites_height = 0;
+    }
+}
+
+// cycle counts from the start of the current CPU slice, the write shows from that pixel of the next line
+static inline void vdp_log_write(const int cycle, const uint8_t type, const uint8_t index, const uint32_t value) {
+    if (vdp_log_count == VDP_LOG_SIZE) {
+        vdp_log_overflow = 1;
+        return;
+    }
+
+    const int pixel = (cycle - VDP_HBLANK_CYCLES) * 3 / 2;
+    vdp_log[vdp_log_count++] = (vdp_event){
+        .line = scanline + 1,
+        .pixel = pixel < 0 ? 0 : pixel > VDP_OUTPUT_WIDTH ? VDP_OUTPUT_WIDTH : pixel,
+        .type = type,
+        .index = index,
+        .value = value,
+    };
+}
+
+// Host RGB of one of the 32 CRAM entries, 12 bit on Game Gear, 6 bit on SMS
+static inline uint32_t vdp_cram_color(const uint8_t index) {
+    if (is_gamegear) {
+        const uint16_t color = vdp.CRAM[index * 2] | vdp.CRAM[index * 2 + 1] << 8;
+        return MFB_RGB((color & 0b1111) << 4, (color >> 4 & 0b1111) << 4, (color >> 8 & 0b1111) << 4);
+    }
+    const uint8_t color = vdp.CRAM[index];
+    return MFB_RGB((color & 3) << 6, (color >> 2 & 3) << 6, (color >> 4 & 3) << 6);
+}
+
+// Reload the whole host palette from CRAM, e.g. after loading a saved state
+static inline void vdp_update_palette() {
+    for (int i = 0; i < 32; i++) {
+        vdp_set_color(i, vdp_cram_color(i));
+    }
+}
+
+// cycle is the CPU cycle within the current slice, for the write log
+static inline void vdp_write(const uint8_t reg, const uint8_t value, const int cycle) {
     switch (reg & 1) {
         case 0: // Data Register
             vdp.latch = 0;
@@ -198,32 +554,35 @@ static inline void vdp_write(const uint8_t reg, const uint8_t value) {
             switch (vdp.code) {
                 case 0:
                 case 1:
-                case 2: VRAM[vdp.address] = value;
+                case 2:
+                    if (vdp_log_vram) {
+                        vdp_log_write(cycle, VDP_EVENT_VRAM, 0, vdp.address | value << 16 | (uint32_t) VRAM[vdp.address] << 24);
+                    }
+                    VRAM[vdp.address] = value;
+                    state_dirty[STATE_VRAM_PAGE_INDEX + (vdp.address >> STATE_PAGE_SHIFT)] = 1;
+                    vdp_invalidate_tile(vdp.address >> 5);
+                    if ((uint16_t) (&VRAM[vdp.address] - vdp.sprites) < SPRITE_COUNT) vdp_sprites_height = 0;
                     break;
                 case 3:
                     vdp.CRAM[vdp.address & 63] = value;
 
                     if (is_gamegear) {
-                        static uint16_t color_latch;
                         if (vdp.address & 1) {
-                            color_latch |= value << 8;
-
-                            mfb_set_pallete(vdp.address >> 1,
-                                            MFB_RGB(
-                                                (color_latch & 0b1111) << 4,
-                                                (color_latch >> 4 & 0b1111) << 4,
-                                                (color_latch >> 8 & 0b1111) << 4)
-                            );
+                            vdp.color_latch |= value << 8;
+
+                            const uint32_t color = MFB_RGB(
+                                (vdp.color_latch & 0b1111) << 4,
+                                (vdp.color_latch >> 4 & 0b1111) << 4,
+                                (vdp.color_latch >> 8 & 0b1111) << 4);
+                            vdp_set_color(vdp.address >> 1 & 31, color);
+                            vdp_log_write(cycle, VDP_EVENT_COLOR, vdp.address >> 1 & 31, color);
                         } else {
-                            color_latch = value;
+                            vdp.color_latch = value;
                         }
                     } else {
-                        mfb_set_pallete(vdp.address & 31,
-                                        MFB_RGB(
-                                            (value & 3) << 6,
-                                            (value >> 2 & 3) << 6,
-                                            (value >> 4 & 3) << 6)
-                        );
+                        const uint32_t color = MFB_RGB((value & 3) << 6, (value >> 2 & 3) << 6, (value >> 4 & 3) << 6);
+                        vdp_set_color(vdp.address & 31, color);
+                        vdp_log_write(cycle, VDP_EVENT_COLOR, vdp.address & 31, color);
                     }
 
                     break;
@@ -233,12 +592,12 @@ static inline void vdp_write(const uint8_t reg, const uint8_t value) {
             break;
         case 1: // Control Register
             if (vdp.latch ^= 1) {
-                control_word = value;
+                vdp.control_word = value;
             } else {
-                control_word |= value << 8;
+                vdp.control_word |= value << 8;
 
-                vdp.code = control_word >> 14;
-                vdp.address = control_word & VRAM_SIZE_WRAP;
+                vdp.code = vdp.control_word >> 14;
+                vdp.address = vdp.control_word & VRAM_SIZE_WRAP;
 
                 if (vdp.code == 0) {
                     vdp.read_buffer = vdp_read_byte();
@@ -246,11 +605,12 @@ static inline void vdp_write(const uint8_t reg, const uint8_t value) {
 
                 if (vdp.code == 2) {
                     // printf("Register write %x %x\n", value & 0xf, control_word & 0xff);
-                    vdp.registers[value & 0xf] = control_word & 0xff;
+                    vdp.registers[value & 0xf] = vdp.control_word & 0xff;
+                    if ((value & 0xf) < sizeof(vdp.registers)) {
+                        vdp_log_write(cycle, VDP_EVENT_REGISTER, value & 0xf, vdp.control_word & 0xff);
+                    }
 
-                    vdp.nametable = &VRAM[(vdp.registers[R2_NAMETABLE_BASE_ADDRESS] << 10) & 0x3800];
-                    vdp.sprites = &VRAM[(vdp.registers[R5_SPRITE_ATTRIBUTE_TABLE_BASE_ADDRESS] << 7) & 0x3F00];
-                    // vdp.sprites += vdp.registers[R6_SPRITE_PATTERN_GENERATOR_TABLE_BASE_ADDRESS] & BIT_2 ? 256 : 0; // 256 or 0
+                    vdp_update_tables();
                 }
             }
             break;
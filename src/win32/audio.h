@@ -2,17 +2,24 @@
 #include <windows.h>
 #include <stdint.h>
 
-#include "../sn76489.h"
-HANDLE updateEvent;
-extern OPLL *ym2413;
-
-#define AUDIO_BUFFER_LENGTH ((SOUND_FREQUENCY / 10))
-static int16_t audio_buffer[AUDIO_BUFFER_LENGTH * 2] = { 0 };
-static int sample_index = 0;
-
-DWORD WINAPI SoundThread(LPVOID lpParam) {
-    WAVEHDR waveHeaders[4];
-
+#include "../sms.h"
+#include "../sound.h"
+
+// Samples produced per emulated frame, the emulation loop generates them with audio_frame()
+#define AUDIO_BUFFER_LENGTH (SOUND_FREQUENCY / FRAMES_PER_SECOND)
+// waveOut plays one frame per block, up to AUDIO_BLOCKS of them are queued, about 100ms
+#define AUDIO_BLOCKS 6
+// audio_wait() gives up on a device that stopped returning blocks
+#define AUDIO_WAIT_TIMEOUT 500
+
+static int16_t audio_buffers[AUDIO_BLOCKS][AUDIO_BUFFER_LENGTH * 2];
+static int16_t audio_buffer[AUDIO_BUFFER_LENGTH * 2]; // takes frames while every block is queued
+static WAVEHDR wave_headers[AUDIO_BLOCKS];
+static HWAVEOUT wave_out;
+static HANDLE audio_event; // set by waveOut whenever it is done with a block
+static uint8_t audio_block;
+
+static int audio_init() {
     WAVEFORMATEX format = {0};
     format.wFormatTag = WAVE_FORMAT_PCM;
     format.nChannels = 2;
@@ -21,79 +28,48 @@ DWORD WINAPI SoundThread(LPVOID lpParam) {
     format.nBlockAlign = format.nChannels * format.wBitsPerSample / 8;
     format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
 
-    HANDLE waveEvent = CreateEvent(NULL, 1, 0, NULL);
+    audio_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!audio_event) return 0;
 
-    HWAVEOUT hWaveOut;
-    waveOutOpen(&hWaveOut, WAVE_MAPPER, &format, (DWORD_PTR) waveEvent, 0, CALLBACK_EVENT);
+    if (waveOutOpen(&wave_out, WAVE_MAPPER, &format, (DWORD_PTR) audio_event, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR) {
+        wave_out = NULL;
+        return 0;
+    }
 
-    for (size_t i = 0; i < 4; i++) {
-        int16_t audio_buffers[4][AUDIO_BUFFER_LENGTH * 2];
-        waveHeaders[i] = (WAVEHDR){
+    for (size_t i = 0; i < AUDIO_BLOCKS; i++) {
+        wave_headers[i] = (WAVEHDR){
             .lpData = (char *) audio_buffers[i],
-            .dwBufferLength = AUDIO_BUFFER_LENGTH * 2,
+            .dwBufferLength = sizeof(audio_buffers[i]),
         };
-        waveOutPrepareHeader(hWaveOut, &waveHeaders[i], sizeof(WAVEHDR));
-        waveHeaders[i].dwFlags |= WHDR_DONE;
+        waveOutPrepareHeader(wave_out, &wave_headers[i], sizeof(WAVEHDR));
+        wave_headers[i].dwFlags |= WHDR_DONE;
     }
-    WAVEHDR *currentHeader = waveHeaders;
-
-
-    while (1) {
-        if (WaitForSingleObject(waveEvent, INFINITE)) {
-            //            fprintf(stderr, "Failed to wait for event.\n");
-            return 1;
-        }
+    return 1;
+}
 
-        if (!ResetEvent(waveEvent)) {
-            //            fprintf(stderr, "Failed to reset event.\n");
-            return 1;
-        }
+// Block until waveOut is done with the block audio_frame() fills next, so the sound card's sample clock paces
+// the emulation. Returns 0 without a device or when it stalls, the caller has to pace frames itself then
+static inline int audio_wait() {
+    const WAVEHDR *header = &wave_headers[audio_block];
 
-        // Wait until audio finishes playing
-        while (currentHeader->dwFlags & WHDR_DONE) {
-            WaitForSingleObject(updateEvent, INFINITE);
-            ResetEvent(updateEvent);
-            //            PSG_calc_stereo(&psg, audiobuffer, AUDIO_BUFFER_LENGTH);
-            memcpy(currentHeader->lpData, audio_buffer, AUDIO_BUFFER_LENGTH * 2);
-            waveOutWrite(hWaveOut, currentHeader, sizeof(WAVEHDR));
-            //waveOutPrepareHeader(hWaveOut, currentHeader, sizeof(WAVEHDR));
-            currentHeader++;
-            if (currentHeader == waveHeaders + 4) { currentHeader = waveHeaders; }
-        }
+    if (!wave_out) return 0;
+    while (!(header->dwFlags & WHDR_DONE)) {
+        if (WaitForSingleObject(audio_event, AUDIO_WAIT_TIMEOUT) != WAIT_OBJECT_0) return 0;
     }
-    return 0;
+    return 1;
 }
 
-DWORD WINAPI TicksThread(LPVOID lpParam) {
-    LARGE_INTEGER start, current, queryperf;
-
-
-    QueryPerformanceFrequency(&queryperf);
-    uint32_t hostfreq = (uint32_t) queryperf.QuadPart;
+// One frame of samples into the next free block, which is queued to waveOut. The chips always advance by a
+// frame, but in turbo mode, which does not audio_wait(), frames arriving while every block is queued are not played
+static inline void audio_frame() {
+    WAVEHDR *header = &wave_headers[audio_block];
 
-    QueryPerformanceCounter(&start); // Get the starting time
-    uint32_t last_sound_tick = 0;
-
-
-    updateEvent = CreateEvent(NULL, 1, 1, NULL);
-    while (1) {
-        QueryPerformanceCounter(&current); // Get the current time
-
-        // Calculate elapsed time in ticks since the start
-        uint32_t elapsedTime = (uint32_t) (current.QuadPart - start.QuadPart);
-
-        if (elapsedTime - last_sound_tick >= hostfreq / SOUND_FREQUENCY) {
-            const int16_t sample =  sn76489_sample() + OPLL_calc(ym2413);
-
-            audio_buffer[sample_index++] = sample;
-            audio_buffer[sample_index++] = sample;
-
-            if (sample_index >= AUDIO_BUFFER_LENGTH) {
-                SetEvent(updateEvent);
-                sample_index = 0;
-            }
-
-            last_sound_tick = elapsedTime;
-        }
+    if (!wave_out || !(header->dwFlags & WHDR_DONE)) {
+        sound_render(audio_buffer, AUDIO_BUFFER_LENGTH, CYCLES_PER_FRAME);
+        return;
     }
-}
\ No newline at end of file
+
+    sound_render(audio_buffers[audio_block], AUDIO_BUFFER_LENGTH, CYCLES_PER_FRAME);
+    waveOutWrite(wave_out, header, sizeof(WAVEHDR));
+    audio_block = (audio_block + 1) % AUDIO_BLOCKS;
+}
@@ -4,14 +4,14 @@
 /**                                                         **/
 /** This file contains the built-in debugging routine for   **/
 /** the Z80 emulator which is called on each Z80 step when  **/
-/** Trap!=0.                                                **/
+/** Trap!=0. DAsm() is also built for the PROFZ80 profiler. **/
 /**                                                         **/
 /** Copyright (C) Marat Fayzullin 1995-2007                 **/
 /**     You are not allowed to distribute this software     **/
 /**     commercially. Please, notify me, if you make any    **/
 /**     changes to this file.                               **/
 /*************************************************************/
-#ifdef DEBUG
+#if defined(DEBUG) || defined(PROFZ80)
 
 #include "Z80.h"
 
@@ -241,7 +241,7 @@ static const char *MnemonicsXCB[256] =
 /** the output text into S. It will return the number of    **/
 /** bytes disassembled.                                     **/
 /*************************************************************/
-static int DAsm(char *S,word A)
+int DAsm(char *S,word A)
 {
   char R[128],H[10],C,*P;
   const char *T;
@@ -308,6 +308,7 @@ static int DAsm(char *S,word A)
   return(B-A);
 }
 
+#ifdef DEBUG
 /** DebugZ80() ***********************************************/
 /** This function should exist if DEBUG is #defined. When   **/
 /** Trace!=0, it is called after each command executed by   **/
@@ -430,5 +431,6 @@ byte DebugZ80(Z80 *R)
   /* Continue emulation */
   return(1);
 }
-
 #endif /* DEBUG */
+
+#endif /* DEBUG || PROFZ80 */
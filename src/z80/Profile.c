@@ -0,0 +1,239 @@
+/** Z80: portable Z80 emulator *******************************/
+/**                                                         **/
+/**                        Profile.c                        **/
+/**                                                         **/
+/** This file contains the instruction profiler which is    **/
+/** fed by ExecZ80() when PROFZ80 is #defined. It counts    **/
+/** instructions and cycles per banked PC and per opcode,   **/
+/** and accesses per I/O port. PCs are disassembled with    **/
+/** DAsm() from Debug.c the first time they are executed,   **/
+/** while their bank is still mapped in.                    **/
+/*************************************************************/
+#ifdef PROFZ80
+
+#include "Z80.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROF_ENTRIES 0x40000   /* Banked PCs, power of two   */
+#define PROF_TEXT    24        /* Disassembly kept per PC    */
+#define PROF_TOP     64        /* Rows in the text report    */
+
+typedef unsigned long long counter;
+
+typedef struct
+{
+  unsigned int Key;            /* (Bank<<16|PC)+1, 0=unused  */
+  counter Count,Cycles;
+  char Text[PROF_TEXT];
+} ProfEntry;
+
+enum { PROF_MAIN,PROF_CB,PROF_ED,PROF_DD,PROF_FD,PROF_DDCB,PROF_FDCB,PROF_GROUPS };
+
+static const char *GroupNames[PROF_GROUPS] =
+{ "","CB","ED","DD","FD","DDCB","FDCB" };
+
+static ProfEntry Entries[PROF_ENTRIES];
+static ProfEntry Overflow = { 0,0,0,"(table full)" };
+static unsigned int Used;
+
+static counter OpCount[PROF_GROUPS*256];   /* [Group<<8|Op] */
+static counter OpCycles[PROF_GROUPS*256];
+static counter PortCount[2*256];           /* [Out<<8|Port] */
+static counter Total,TotalCycles;
+
+static ProfEntry *Current = &Overflow;
+static byte Group,Op;
+
+/** ProfStartZ80() *******************************************/
+/** Called by ExecZ80() before executing instruction at PC. **/
+/*************************************************************/
+void ProfStartZ80(register word PC)
+{
+  unsigned int Key,J;
+  char S[128];
+
+  Key = ((unsigned int)BankZ80(PC)<<16|PC)+1;
+  for(J=(Key*2654435761u>>12)&(PROF_ENTRIES-1);Entries[J].Key!=Key;J=(J+1)&(PROF_ENTRIES-1))
+    if(!Entries[J].Key)
+    {
+      /* Keep one slot free so that lookups terminate */
+      if(Used>=PROF_ENTRIES-1) { J=PROF_ENTRIES;break; }
+      Used++;
+      Entries[J].Key=Key;
+      DAsm(S,PC);
+      S[PROF_TEXT-1]='\0';
+      strcpy(Entries[J].Text,S);
+      break;
+    }
+  Current = J<PROF_ENTRIES? &Entries[J]:&Overflow;
+
+  Op=RdZ80(PC);
+  switch(Op)
+  {
+    case 0xCB: Group=PROF_CB;Op=RdZ80(PC+1);break;
+    case 0xED: Group=PROF_ED;Op=RdZ80(PC+1);break;
+    case 0xDD:
+    case 0xFD:
+      Group = Op==0xDD? PROF_DD:PROF_FD;
+      Op    = RdZ80(PC+1);
+      if(Op==0xCB) { Group+=PROF_DDCB-PROF_DD;Op=RdZ80(PC+3); }
+      break;
+    default:   Group=PROF_MAIN;break;
+  }
+}
+
+/** ProfEndZ80() *********************************************/
+/** Called by ExecZ80() with cycles the instruction took.   **/
+/*************************************************************/
+void ProfEndZ80(register int Cycles)
+{
+  Current->Count++;
+  Current->Cycles+=Cycles;
+  OpCount[Group<<8|Op]++;
+  OpCycles[Group<<8|Op]+=Cycles;
+  Total++;
+  TotalCycles+=Cycles;
+}
+
+/** ProfPortZ80() ********************************************/
+/** Called on every InZ80() (Out=0) and OutZ80() (Out=1).   **/
+/*************************************************************/
+void ProfPortZ80(register word Port,register byte Out)
+{
+  PortCount[(Out!=0)<<8|(Port&0xFF)]++;
+}
+
+/** ResetProfileZ80() ****************************************/
+/** Clear all counters.                                     **/
+/*************************************************************/
+void ResetProfileZ80(void)
+{
+  memset(Entries,0,sizeof(Entries));
+  memset(OpCount,0,sizeof(OpCount));
+  memset(OpCycles,0,sizeof(OpCycles));
+  memset(PortCount,0,sizeof(PortCount));
+  Overflow.Count=Overflow.Cycles=0;
+  Used=Total=TotalCycles=0;
+  Current=&Overflow;
+}
+
+/** Sorting helpers ******************************************/
+static int ByCycles(const void *A,const void *B)
+{
+  counter X=(*(ProfEntry *const *)A)->Cycles;
+  counter Y=(*(ProfEntry *const *)B)->Cycles;
+  return(X<Y? 1:X>Y? -1:0);
+}
+
+static int ByOpCycles(const void *A,const void *B)
+{
+  counter X=OpCycles[*(const int *)A];
+  counter Y=OpCycles[*(const int *)B];
+  return(X<Y? 1:X>Y? -1:0);
+}
+
+static int ByPortCount(const void *A,const void *B)
+{
+  counter X=PortCount[*(const int *)A];
+  counter Y=PortCount[*(const int *)B];
+  return(X<Y? 1:X>Y? -1:0);
+}
+
+static double Percent(counter Cycles)
+{
+  return(TotalCycles? 100.0*Cycles/TotalCycles:0.0);
+}
+
+/** SaveProfileZ80() *****************************************/
+/** Write counters sorted by cycles, as CSV if FileName     **/
+/** ends with ".csv", else as a text report. NULL FileName  **/
+/** writes the report to stdout. Returns 0 on failure.      **/
+/*************************************************************/
+int SaveProfileZ80(const char *FileName)
+{
+  ProfEntry **Sorted;
+  int Ops[PROF_GROUPS*256],Ports[2*256];
+  unsigned int N,J;
+  size_t L;
+  int CSV;
+  FILE *F;
+
+  /* Collect used PCs, the overflow bucket last */
+  Sorted=malloc((Used+1)*sizeof(ProfEntry *));
+  if(!Sorted) return(0);
+  for(J=N=0;J<PROF_ENTRIES;J++)
+    if(Entries[J].Key) Sorted[N++]=&Entries[J];
+  qsort(Sorted,N,sizeof(ProfEntry *),ByCycles);
+  if(Overflow.Count) Sorted[N++]=&Overflow;
+
+  for(J=0;J<PROF_GROUPS*256;J++) Ops[J]=J;
+  qsort(Ops,PROF_GROUPS*256,sizeof(int),ByOpCycles);
+  for(J=0;J<2*256;J++) Ports[J]=J;
+  qsort(Ports,2*256,sizeof(int),ByPortCount);
+
+  F = FileName? fopen(FileName,"w"):stdout;
+  if(!F) { free(Sorted);return(0); }
+  L   = FileName? strlen(FileName):0;
+  CSV = (L>=4)&&!strcmp(FileName+L-4,".csv");
+
+  if(CSV)
+  {
+    fprintf(F,"kind,bank,address,count,cycles,text\n");
+    for(J=0;J<N;J++)
+    {
+      const ProfEntry *E=Sorted[J];
+      if(E==&Overflow) fprintf(F,"pc,,,");
+      else if(((E->Key-1)>>16)==PROF_NOBANK) fprintf(F,"pc,,%04X,",(E->Key-1)&0xFFFF);
+      else fprintf(F,"pc,%02X,%04X,",(E->Key-1)>>16,(E->Key-1)&0xFFFF);
+      fprintf(F,"%llu,%llu,\"%s\"\n",E->Count,E->Cycles,E->Text);
+    }
+    for(J=0;(J<PROF_GROUPS*256)&&OpCount[Ops[J]];J++)
+      fprintf(F,"op,,%s%02X,%llu,%llu,\n",
+        GroupNames[Ops[J]>>8],Ops[J]&0xFF,OpCount[Ops[J]],OpCycles[Ops[J]]);
+    for(J=0;(J<2*256)&&PortCount[Ports[J]];J++)
+      fprintf(F,"%s,,%02X,%llu,,\n",
+        Ports[J]>>8? "out":"in",Ports[J]&0xFF,PortCount[Ports[J]]);
+  }
+  else
+  {
+    counter Count,Cycles;
+    int G;
+
+    fprintf(F,"Z80 profile: %llu instructions, %llu cycles, %u PCs\n",Total,TotalCycles,Used);
+
+    fprintf(F,"\nPrefix        Instructions          Cycles       %%\n");
+    for(G=0;G<PROF_GROUPS;G++)
+    {
+      for(J=0,Count=Cycles=0;J<256;J++) { Count+=OpCount[G<<8|J];Cycles+=OpCycles[G<<8|J]; }
+      fprintf(F,"%-6s  %18llu  %14llu  %6.2f\n",G? GroupNames[G]:"none",Count,Cycles,Percent(Cycles));
+    }
+
+    fprintf(F,"\nOpcode        Instructions          Cycles       %%\n");
+    for(J=0;(J<PROF_TOP)&&OpCount[Ops[J]];J++)
+      fprintf(F,"%4s %02X  %18llu  %14llu  %6.2f\n",
+        GroupNames[Ops[J]>>8],Ops[J]&0xFF,OpCount[Ops[J]],OpCycles[Ops[J]],Percent(OpCycles[Ops[J]]));
+
+    fprintf(F,"\nBank:PC       Instructions          Cycles       %%  Code\n");
+    for(J=0;(J<PROF_TOP)&&(J<N);J++)
+    {
+      const ProfEntry *E=Sorted[J];
+      if(E==&Overflow) fprintf(F,"  --:----");
+      else if(((E->Key-1)>>16)==PROF_NOBANK) fprintf(F,"  --:%04X",(E->Key-1)&0xFFFF);
+      else fprintf(F,"  %02X:%04X",(E->Key-1)>>16,(E->Key-1)&0xFFFF);
+      fprintf(F,"  %16llu  %14llu  %6.2f  %s\n",E->Count,E->Cycles,Percent(E->Cycles),E->Text);
+    }
+
+    fprintf(F,"\nPort         Accesses\n");
+    for(J=0;(J<2*256)&&PortCount[Ports[J]];J++)
+      fprintf(F,"%-3s %02X  %12llu\n",Ports[J]>>8? "Out":"In",Ports[J]&0xFF,PortCount[Ports[J]]);
+  }
+
+  free(Sorted);
+  if(F!=stdout) fclose(F);
+  return(1);
+}
+
+#endif /* PROFZ80 */
@@ -0,0 +1,152 @@
+/** Z80: portable Z80 emulator *******************************/
+/**                                                         **/
+/**                         Threaded.h                      **/
+/**                                                         **/
+/** This file implements computed goto dispatch of a Z80    **/
+/** opcode table. It is included from Z80.c right before    **/
+/** the switch(I) it replaces, with THREAD_CODES naming the **/
+/** table and THREAD_NEXT dispatching the next opcode.      **/
+/** Every opcode gets its own copy of the table switched on **/
+/** a constant, which the compiler reduces to that opcode's **/
+/** case. THREAD_CASES may "goto ThreadDefault" to fall     **/
+/** back to the regular switch(I) following this file.      **/
+/*************************************************************/
+#if !defined(THREAD_HI)
+
+#define THREAD_LABEL(Hi,Lo)  THREAD_PASTE(Hi,Lo)
+#define THREAD_PASTE(Hi,Lo)  T_##Hi##_##Lo
+#define THREAD_ROW(Hi) \
+  &&T_##Hi##_0,&&T_##Hi##_1,&&T_##Hi##_2,&&T_##Hi##_3,     \
+  &&T_##Hi##_4,&&T_##Hi##_5,&&T_##Hi##_6,&&T_##Hi##_7,     \
+  &&T_##Hi##_8,&&T_##Hi##_9,&&T_##Hi##_10,&&T_##Hi##_11,   \
+  &&T_##Hi##_12,&&T_##Hi##_13,&&T_##Hi##_14,&&T_##Hi##_15
+
+{
+  static const void *const Thread[256] =
+  {
+    THREAD_ROW(0),THREAD_ROW(1),THREAD_ROW(2),THREAD_ROW(3),
+    THREAD_ROW(4),THREAD_ROW(5),THREAD_ROW(6),THREAD_ROW(7),
+    THREAD_ROW(8),THREAD_ROW(9),THREAD_ROW(10),THREAD_ROW(11),
+    THREAD_ROW(12),THREAD_ROW(13),THREAD_ROW(14),THREAD_ROW(15)
+  };
+
+  goto *Thread[I];
+
+#define THREAD_HI 0
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 1
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 2
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 3
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 4
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 5
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 6
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 7
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 8
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 9
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 10
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 11
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 12
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 13
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 14
+#include "Threaded.h"
+#undef THREAD_HI
+#define THREAD_HI 15
+#include "Threaded.h"
+#undef THREAD_HI
+
+ThreadDefault: __attribute__((unused));
+}
+
+#undef THREAD_LABEL
+#undef THREAD_PASTE
+#undef THREAD_ROW
+
+#elif !defined(THREAD_LO)
+
+#define THREAD_LO 0
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 1
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 2
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 3
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 4
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 5
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 6
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 7
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 8
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 9
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 10
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 11
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 12
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 13
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 14
+#include "Threaded.h"
+#undef THREAD_LO
+#define THREAD_LO 15
+#include "Threaded.h"
+#undef THREAD_LO
+
+#else
+
+THREAD_LABEL(THREAD_HI,THREAD_LO):
+  switch(THREAD_HI*16+THREAD_LO)
+  {
+#include THREAD_CODES
+    THREAD_CASES
+  }
+  THREAD_NEXT;
+
+#endif
@@ -51,6 +51,14 @@ extern byte *Page[];
 INLINE byte RdZ80(word A) { return(Page[A>>13][A&0x1FFF]); }
 #endif
 
+#ifdef SMS
+#define RdZ80 RDZ80
+#define FAST_RDOP
+extern byte *read_page[];
+INLINE byte RdZ80(word A) { return(read_page[A>>10][A&0x03FF]); }
+INLINE byte OpZ80(word A) { return(read_page[A>>10][A&0x03FF]); }
+#endif
+
 #ifdef FMSX
 #define FAST_RDOP
 extern byte *RAM[];
@@ -327,12 +335,58 @@ enum CodesED
   DB_F8,DB_F9,DB_FA,DB_FB,DB_FC,DB_FD,DB_FE,DB_FF
 };
 
+/** PROFZ80 **************************************************/
+/** With this #define present, ExecZ80() reports every      **/
+/** executed instruction and its cycles to Profile.c, and   **/
+/** InZ80()/OutZ80() calls are counted per port.            **/
+/*************************************************************/
+#ifdef PROFZ80
+#ifdef THREADZ80
+#error "PROFZ80 can not be used with THREADZ80"
+#endif
+
+INLINE void OutProfZ80(word Port,byte Value)
+{
+  ProfPortZ80(Port,1);
+  OutZ80(Port,Value);
+}
+
+INLINE byte InProfZ80(word Port)
+{
+  ProfPortZ80(Port,0);
+  return(InZ80(Port));
+}
+
+#define OutZ80 OutProfZ80
+#define InZ80  InProfZ80
+
+/* Cycles left, with the ones EI sets aside in IBackup */
+#define PROF_ICOUNT(R) \
+  ((R)->IFF&IFF_EI? (R)->ICount+(R)->IBackup-1:(R)->ICount)
+#endif /* PROFZ80 */
+
+/** THREADZ80 ************************************************/
+/** With this #define present, ExecZ80() and the prefixed   **/
+/** opcode tables dispatch through computed goto jump       **/
+/** tables (GCC labels-as-values) instead of switch(I).     **/
+/** Prefixed opcodes return to ExecZ80() when done.         **/
+/*************************************************************/
+#ifdef THREADZ80
+#define THREAD_NEXT  return
+#define THREAD_CASES default: goto ThreadDefault;
+#endif
+
 static void CodesCB(register Z80 *R)
 {
   register byte I;
 
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesCB[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesCB.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesCB.h"
@@ -355,6 +409,11 @@ static void CodesDDCB(register Z80 *R)
   J.W=R->XX.W+(offset)OpZ80(R->PC.W++);
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesXXCB[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesXCB.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesXCB.h"
@@ -378,6 +437,11 @@ static void CodesFDCB(register Z80 *R)
   J.W=R->XX.W+(offset)OpZ80(R->PC.W++);
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesXXCB[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesXCB.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesXCB.h"
@@ -399,6 +463,11 @@ static void CodesED(register Z80 *R)
 
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesED[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesED.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesED.h"
@@ -422,6 +491,11 @@ static void CodesDD(register Z80 *R)
 #define XX IX
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesXX[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesXX.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesXX.h"
@@ -449,6 +523,11 @@ static void CodesFD(register Z80 *R)
 #define XX IY
   I=OpZ80(R->PC.W++);
   R->ICount-=CyclesXX[I];
+#ifdef THREADZ80
+#define THREAD_CODES "CodesXX.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#endif
   switch(I)
   {
 #include "CodesXX.h"
@@ -506,6 +585,9 @@ int ExecZ80(register Z80 *R,register int RunCycles)
 {
   register byte I;
   register pair J;
+#ifdef PROFZ80
+  int ProfCycles;
+#endif
 
   for(R->ICount=RunCycles;;)
   {
@@ -519,11 +601,39 @@ int ExecZ80(register Z80 *R,register int RunCycles)
         if(!DebugZ80(R)) return(R->ICount);
 #endif
 
+#ifdef PROFZ80
+      /* Account instruction at PC */
+      ProfStartZ80(R->PC.W);
+      ProfCycles=PROF_ICOUNT(R);
+#endif
+
       /* Read opcode and count cycles */
       I=OpZ80(R->PC.W++);
       /* Count cycles */
       R->ICount-=Cycles[I];
 
+#ifdef THREADZ80
+      /* Interpret opcode, then fetch the next one right away */
+#undef THREAD_NEXT
+#ifdef DEBUG
+#define THREAD_NEXT continue
+#else
+#define THREAD_NEXT \
+  if(R->ICount<=0) break; \
+  I=OpZ80(R->PC.W++);R->ICount-=Cycles[I]; \
+  goto *Thread[I]
+#endif
+#undef THREAD_CASES
+#define THREAD_CASES \
+  case PFX_CB: case PFX_ED: case PFX_FD: case PFX_DD: \
+    goto ThreadDefault;
+#define THREAD_CODES "Codes.h"
+#include "Threaded.h"
+#undef THREAD_CODES
+#undef THREAD_CASES
+#undef THREAD_NEXT
+#endif
+
       /* Interpret opcode */
       switch(I)
       {
@@ -533,6 +643,10 @@ int ExecZ80(register Z80 *R,register int RunCycles)
         case PFX_FD: CodesFD(R);break;
         case PFX_DD: CodesDD(R);break;
       }
+
+#ifdef PROFZ80
+      ProfEndZ80(ProfCycles-PROF_ICOUNT(R));
+#endif
     }
 
     /* Unless we have come here after EI, exit */
@@ -162,6 +162,33 @@ void PatchZ80(register Z80 *R);
 byte DebugZ80(register Z80 *R);
 #endif
 
+/** DAsm() ***************************************************/
+/** Disassemble code at address A into S, return its length **/
+/** in bytes. Lives in Debug.c.                             **/
+/*************************************************************/
+#if defined(DEBUG) || defined(PROFZ80)
+int DAsm(char *S,word A);
+#endif
+
+/** Profiler *************************************************/
+/** With PROFZ80 #defined, ExecZ80() counts instructions    **/
+/** and cycles per banked PC and per opcode, and accesses   **/
+/** per I/O port. SaveProfileZ80() writes them sorted into  **/
+/** FileName: as CSV if it ends with ".csv", else as a text **/
+/** report. NULL FileName means stdout. Returns 0 on error. **/
+/** BankZ80() returns the memory bank mapped at address A,  **/
+/** PROF_NOBANK if it is not banked. Lives in Profile.c.    **/
+/*************************************************************/
+#ifdef PROFZ80
+#define PROF_NOBANK 0xFF
+byte BankZ80(register word A);  /* TO BE WRITTEN BY USER */
+void ProfStartZ80(register word PC);
+void ProfEndZ80(register int Cycles);
+void ProfPortZ80(register word Port,register byte Out);
+void ResetProfileZ80(void);
+int SaveProfileZ80(const char *FileName);
+#endif
+
 /** LoopZ80() ************************************************/
 /** Z80 emulation calls this function periodically to check **/
 /** if the system hardware requires any interrupts. This    **/